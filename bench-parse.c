@@ -0,0 +1,86 @@
+/*
+ *	Minsk-2 Emulator -- Parser Benchmark
+ *
+ *	(c) 2010 Martin Mares <mj@ucw.cz>
+ */
+
+/*
+ *  Measures how fast minsk_load() parses programs in the text format.
+ *  The input is a generated table of random words in the usual layout,
+ *  interleaved with addresses and comments. Usage: bench-parse [<MB>]
+ */
+
+#define _GNU_SOURCE
+
+#include "minsk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *generate(size_t size, size_t *len)
+{
+  char *buf = malloc(size + 128);
+  size_t pos = 0;
+  unsigned int seed = 1;
+
+  if (!buf)
+    return NULL;
+  while (pos < size)
+    {
+      int r = rand_r(&seed);
+      if (r % 64 == 0)
+	pos += sprintf(buf + pos, "@%04o\n", r % 07777);
+      else if (r % 64 == 1)
+	pos += sprintf(buf + pos, "; Random data, line %zu\n", pos);
+      else
+	pos += sprintf(buf + pos, "%c%02o %02o %04o %04o\n", (r & 64) ? '-' : '+',
+		       rand_r(&seed) % 0100, rand_r(&seed) % 0100, rand_r(&seed) % 010000, rand_r(&seed) % 010000);
+    }
+  *len = pos;
+  return buf;
+}
+
+int main(int argc, char **argv)
+{
+  size_t size = (argc > 1 ? atoi(argv[1]) : 16) << 20;
+  size_t len;
+  char *text = generate(size, &len);
+  struct minsk_machine *m = minsk_new(1);
+  if (!text || !m)
+    {
+      fprintf(stderr, "bench-parse: Out of memory\n");
+      return 1;
+    }
+
+  double best = 0;
+  for (int round=0; round<20; round++)
+    {
+      FILE *in = fmemopen(text, len, "r");
+      minsk_reset(m);
+      double start = now();
+      enum minsk_status status = minsk_load(m, in);
+      double t = now() - start;
+      fclose(in);
+      if (status != MINSK_RUNNING)
+	{
+	  minsk_report(m, stderr, 1);
+	  return 1;
+	}
+      if (!round || t < best)
+	best = t;
+    }
+
+  printf("Parsed %.1f MB in %.3f s: %.1f MB/s\n", len / 1048576., best, len / 1048576. / best);
+  minsk_free(m);
+  free(text);
+  return 0;
+}
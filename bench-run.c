@@ -0,0 +1,205 @@
+/*
+ *	Minsk-2 Emulator -- Benchmark Harness
+ *
+ *	(c) 2010 Martin Mares <mj@ucw.cz>
+ */
+
+/*
+ *  Runs the programs given as arguments (normally the corpus in bench/)
+ *  several times each and reports the best and total wall time, emulated
+ *  instructions per second and printed lines per second. Programs whose
+ *  name ends with "-22" run on the Minsk-22. Finally, the parser is timed
+ *  on all the programs. Every result is a line of JSON, so that results
+ *  can be collected across releases. Usage: bench-run [-n <runs>] <program>...
+ */
+
+#define _GNU_SOURCE
+
+#include "minsk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <getopt.h>
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *read_file(const char *name, size_t *len)
+{
+  FILE *f = fopen(name, "r");
+  if (!f)
+    return NULL;
+  char *buf = NULL;
+  size_t size = 0;
+  int err = 0;
+  *len = 0;
+  for (;;)
+    {
+      if (*len == size)
+	{
+	  char *nbuf = realloc(buf, size = 2*size + 4096);
+	  if (!nbuf)
+	    {
+	      err = 1;
+	      break;
+	    }
+	  buf = nbuf;
+	}
+      size_t n = fread(buf + *len, 1, size - *len, f);
+      if (!n)
+	break;
+      *len += n;
+    }
+  if (ferror(f))
+    err = 1;
+  fclose(f);
+  if (err)
+    {
+      free(buf);
+      return NULL;
+    }
+  return buf;
+}
+
+static const char *base_name(const char *name)
+{
+  const char *slash = strrchr(name, '/');
+  return slash ? slash+1 : name;
+}
+
+static struct minsk_machine *new_machine(const char *name, FILE *out)
+{
+  size_t len = strlen(name);
+  struct minsk_machine *m = minsk_new((len >= 3 && !strcmp(name + len - 3, "-22")) ? 2 : 1);
+  if (!m)
+    {
+      fprintf(stderr, "bench-run: Out of memory\n");
+      exit(1);
+    }
+  minsk_set_output(m, out);
+  minsk_set_recorder(m, 0);
+  // Quotas which never run out, but count what was used
+  minsk_set_cpu_quota(m, INT_MAX);
+  minsk_set_print_quota(m, INT_MAX);
+  return m;
+}
+
+static int bench(const char *name, const char *text, size_t len, int runs, FILE *out)
+{
+  struct minsk_machine *m = new_machine(name, out);
+  struct minsk_usage usage;
+  double best = 0, total = 0;
+
+  for (int round=0; round<runs; round++)
+    {
+      FILE *in = fmemopen((char *) text, len, "r");
+      minsk_reset(m);
+      minsk_load(m, in);
+      fclose(in);
+      if (minsk_status(m) != MINSK_RUNNING)
+	break;
+      double start = now();
+      minsk_run(m);
+      double t = now() - start;
+      total += t;
+      if (!round || t < best)
+	best = t;
+    }
+
+  if (minsk_status(m) != MINSK_HALTED)
+    {
+      fprintf(stderr, "bench-run: %s: ", name);
+      minsk_report(m, stderr, 1);
+      minsk_free(m);
+      return 0;
+    }
+
+  minsk_get_usage(m, &usage);
+  printf("{\"bench\": \"%s\", \"runs\": %d, \"instructions\": %d, \"lines\": %d, "
+	 "\"best_s\": %.6f, \"total_s\": %.6f, \"mips\": %.2f, \"lines_per_s\": %.0f}\n",
+	 base_name(name), runs, usage.instructions, usage.lines,
+	 best, total, usage.instructions / best / 1e6, usage.lines / best);
+  minsk_free(m);
+  return 1;
+}
+
+// Parse all programs over and over for at least a tenth of a second
+static void bench_parser(char **texts, size_t *lens, int n, FILE *out)
+{
+  struct minsk_machine *m = new_machine("", out);
+  size_t bytes = 0;
+  double start = now(), t;
+
+  do
+    for (int i=0; i<n; i++)
+      {
+	FILE *in = fmemopen(texts[i], lens[i], "r");
+	minsk_reset(m);
+	minsk_load(m, in);
+	fclose(in);
+	bytes += lens[i];
+      }
+  while ((t = now() - start) < 0.1);
+  printf("{\"bench\": \"parser\", \"programs\": %d, \"bytes\": %zu, \"total_s\": %.6f, \"mb_per_s\": %.2f}\n",
+	 n, bytes, t, bytes / 1048576. / t);
+  minsk_free(m);
+}
+
+int main(int argc, char **argv)
+{
+  int runs = 5;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:")) >= 0)
+    switch (opt)
+      {
+      case 'n':
+	runs = atoi(optarg);
+	break;
+      default:
+	goto usage;
+      }
+  if (optind >= argc || runs <= 0)
+    {
+    usage:
+      fprintf(stderr, "Usage: bench-run [-n <runs>] <program>...\n");
+      return 1;
+    }
+
+  // The printer output is of no interest, but it should cost what it does
+  FILE *out = fopen("/dev/null", "w");
+  if (!out)
+    {
+      fprintf(stderr, "bench-run: Cannot open /dev/null\n");
+      return 1;
+    }
+
+  int n = argc - optind;
+  char **names = argv + optind;
+  char *texts[n];
+  size_t lens[n];
+  int errors = 0;
+  for (int i=0; i<n; i++)
+    {
+      if (!(texts[i] = read_file(names[i], &lens[i])))
+	{
+	  fprintf(stderr, "bench-run: Cannot read %s\n", names[i]);
+	  return 1;
+	}
+      if (!bench(names[i], texts[i], lens[i], runs, out))
+	errors++;
+    }
+  bench_parser(texts, lens, n, out);
+
+  for (int i=0; i<n; i++)
+    free(texts[i]);
+  fclose(out);
+  return errors ? 1 : 0;
+}
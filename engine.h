@@ -0,0 +1,401 @@
+/*
+ *	Minsk-2 Emulator -- The Interpreter Loop
+ *
+ *	This file is included by machine.c once for every variant of the
+ *	interpreter. Before including it, define:
+ *
+ *	ENGINE		name of the function to generate
+ *	TRACING		trace level the engine supports (0 to 3, TRACE_BINARY,
+ *			or an expression)
+ *	BLOCKS		charge the CPU quota per basic block; the engine
+ *			returns when the quota would run out within a block
+ *	PROFILE		count instructions and jumps in the profile
+ *	STEP		return after executing a single instruction
+ *	MINSK22		operands can live in memory blocks other than 0;
+ *			if not set, the block numbers are ignored
+ *
+ *	The engine returns the status of the machine, which stays
+ *	MINSK_RUNNING if it returned without the machine stopping.
+ */
+
+static enum minsk_status ENGINE(struct minsk_machine *m)
+{
+  decoded *d;
+  int op, ix;
+  loc x, y;				// Operands (original form)
+  loc xi, yi;				// (indexed form)
+
+  /* Arithmetic operations */
+
+  word a, b, c;
+  long long aa, bb, cc;
+  int i;
+
+  m->host = ENGINE_HOST;
+
+#ifdef ENABLE_THREADED_DISPATCH
+  static const void * const dispatch[FUSED_MAX] = {
+    [000] = &&op_000,
+    [001 ... 003] = &&op_illegal,
+    AOPS_DISPATCH(004, 005, 006, 007),
+    AOPS_DISPATCH(010, 011, 012, 013),
+    AOPS_DISPATCH(014, 015, 016, 017),
+    AOPS_DISPATCH(020, 021, 022, 023),
+    AOPS_DISPATCH(024, 025, 026, 027),
+    AOPS_DISPATCH(030, 031, 032, 033),
+    AOPS_DISPATCH(034, 035, 036, 037),
+    AOPS_DISPATCH(040, 041, 042, 043),
+    AOPS_DISPATCH(044, 045, 046, 047),
+    AOPS_DISPATCH(050, 051, 052, 053),
+    AOPS_DISPATCH(054, 055, 056, 057),
+    AOPS_DISPATCH(060, 061, 062, 063),
+    AOPS_DISPATCH(064, 065, 066, 067),
+    AOPS_DISPATCH(070, 071, 072, 073),
+    AOPS_DISPATCH(074, 075, 076, 077),
+    [0100] = &&op_0100,
+    [0101 ... 0102] = &&op_illegal,
+    [0103] = &&op_0103,
+    [0104] = &&op_0104,
+    [0105] = &&op_0105,
+    [0106] = &&op_0106,
+    [0107] = &&op_0107,
+    [0110] = &&op_0110,
+    [0111] = &&op_0111,
+    [0112] = &&op_0112,
+    [0113] = &&op_0113,
+    [0114] = &&op_0114,
+    [0115] = &&op_0115,
+    [0116] = &&op_0116,
+    [0117] = &&op_0117,
+    [0120] = &&op_0120,
+    [0121 ... 0127] = &&op_illegal,
+    [0130] = &&op_0130,
+    [0131] = &&op_0131,
+    [0132] = &&op_0132,
+    [0133] = &&op_0133,
+    [0134] = &&op_0134,
+    [0135] = &&op_0135,
+    [0136] = &&op_0136,
+    [0137] = &&op_0137,
+    [0140 ... 0147] = &&op_0140,
+    [0150 ... 0154] = &&op_0150,
+    [0155 ... 0157] = &&op_illegal,
+    [0160 ... 0161] = &&op_0160,
+    [0162] = &&op_0162,
+    [0163] = &&op_0163,
+    [0164 ... 0167] = &&op_illegal,
+    [0170] = &&op_0170,
+    [0171] = &&op_0171,
+    [0172] = &&op_0172,
+    [0173] = &&op_0173,
+    [0174] = &&op_0174,
+    [0175] = &&op_0175,
+    [0176] = &&op_0176,
+    [0177 ... 0200] = &&op_illegal,
+    FUSED_DISPATCH(FUSED_ADD_XOR),
+    FUSED_DISPATCH(FUSED_ADD_XOR_LOOP),
+    FUSED_DISPATCH(FUSED_XOR_LOOP),
+    FUSED_DISPATCH(FUSED_SUB_LOOP),
+    FUSED_DISPATCH(FUSED_FPSUB_LOOP),
+    FUSED_DISPATCH(FUSED_MOVE_ADD),
+    FUSED_DISPATCH(FUSED_MOVE_ADD_XOR_LOOP),
+    FUSED_DISPATCH(FUSED_SUB_JPOS),
+    FUSED_DISPATCH(FUSED_SUB_JZERO),
+    [FUSED_LOOP_ADD] = &&op_0120,
+    [FUSED_LOOP_MOVE] = &&op_0120,
+  };
+
+  ENTER_BLOCK;
+  FETCH;
+  goto *dispatch[op];
+#else
+  ENTER_BLOCK;
+  for (;;)
+    {
+      FETCH;
+      switch (op)
+	{
+#endif
+	OP(000)			// NOP
+	  NEXT;
+	AOPS(004, 005, 006, 007,	// XOR
+	  ASTORE(a^b))
+	AOPS(010, 011, 012, 013,	// FIX addition
+	  ASTORE_INT(wtoll(a) + wtoll(b)))
+	AOPS(014, 015, 016, 017,	// FP addition
+	  ASTORE_CHECK(fp_addsub(a, b, 0)))
+	AOPS(020, 021, 022, 023,	// FIX subtraction
+	  ASTORE_INT(wtoll(a) - wtoll(b)))
+	AOPS(024, 025, 026, 027,	// FP subtraction
+	  ASTORE_CHECK(fp_addsub(a, b, 1)))
+	AOPS(030, 031, 032, 033,	// FIX multiplication
+	  ASTORE(fix_mul(a, b)))
+	AOPS(034, 035, 036, 037,	// FP multiplication
+	  ASTORE_CHECK(fp_mul(a, b)))
+	AOPS(040, 041, 042, 043,	// FIX division
+	  ASTORE_CHECK(fix_div(a, b)))
+	AOPS(044, 045, 046, 047,	// FP division
+	  ASTORE_CHECK(fp_div(a, b)))
+	AOPS(050, 051, 052, 053,	// FIX subtraction of abs values
+	  ASTORE_INT(wabs(a) - wabs(b)))
+	AOPS(054, 055, 056, 057,	// FP subtraction of abs values (operands are never negative)
+	  ASTORE_CHECK(fp_addsub(a, b, 1)))
+	AOPS(060, 061, 062, 063,	// Shift logical
+	  i = wexp(b);
+	  if (i <= -37 || i >= 37)
+	    ASTORE(0);
+	  else if (i >= 0)
+	    ASTORE((a << i) & WORD_MASK);
+	  else
+	    ASTORE(a >> (-i)))
+	AOPS(064, 065, 066, 067,	// Shift arithmetical
+	  i = wexp(b);
+	  aa = wabs(a);
+	  if (i <= -36 || i >= 36)
+	    cc = 0;
+	  else if (i >= 0)
+	    cc = (aa << i) & VAL_MASK;
+	  else
+	    cc = aa >> (-i);
+	  ASTORE((a & SIGN_MASK) | wfromll(cc)))
+	AOPS(070, 071, 072, 073,	// And
+	  ASTORE(a&b))
+	AOPS(074, 075, 076, 077,	// Or
+	  ASTORE(a|b))
+
+	OP(0100)		// Halt
+	  m->r1 = RD(x);
+	  m->acc = RD(y);
+	  return stop(m, MINSK_HALTED);
+	OP(0103)		// I/O magtape
+	  return notimp(m);
+	OP(0104)		// Disable rounding
+	  return notimp(m);
+	OP(0105)		// Enable rounding
+	  return notimp(m);
+	OP(0106)		// Interrupt control
+	  return notimp(m);
+	OP(0107)		// Reverse tape
+	  return notimp(m);
+	OP(0110)		// Move
+	  WR(yi, m->r1 = m->acc = RD(xi));
+	  NEXT;
+	OP(0111)		// Move negative
+	  WR(yi, m->acc = (m->r1 = RD(xi)) ^ SIGN_MASK);
+	  NEXT;
+	OP(0112)		// Move absolute value
+	  WR(yi, m->acc = (m->r1 = RD(xi)) & VAL_MASK);
+	  NEXT;
+	OP(0113)		// Read from keyboard
+	  return notimp(m);
+	OP(0114)		// Copy sign
+	  WR(yi, m->acc = RD(yi) ^ ((m->r1 = RD(xi)) & SIGN_MASK));
+	  NEXT;
+	OP(0115)		// Read code from R1 (obscure)
+	  return notimp(m);
+	OP(0116)		// Copy exponent
+	  WR(yi, m->acc = wputexp(RD(yi), wexp(m->r1 = RD(xi))));
+	  NEXT;
+	OP(0117)		// I/O teletype
+	  return notimp(m);
+	OP(0120)		// Loop
+	  {
+	    if (!ix)
+	      return noins(m);
+	    loc iaddr = { 0, ix };
+	    a = m->r1 = RD(iaddr);
+	    aa = (a >> 24) & 017777;
+	    if (!aa)
+	      {
+		ENTER_BLOCK;
+		JIT_TRY;
+		NEXT;
+	      }
+	    b = RD(y);		// (a mountain range near Prague)
+	    m->acc = ((aa-1) << 24) |
+		  (((((a >> 12) & 07777) + (b >> 12) & 07777) & 07777) << 12) |
+		  (((a & 07777) + (b & 07777)) & 07777);
+	    WR(iaddr, m->acc);
+	    m->ip = x.address;
+	    if (BLOCKS && d->idiom)
+	      bulk_loop(m, d);
+	  }
+	  ENTER_BLOCK;
+	  JIT_TRY;
+	  LOOP_NEXT;
+	OP(0130)		// Jump
+	  WR(y, m->r2);
+	  m->ip = x.address;
+	  ENTER_BLOCK;
+	  JIT_TRY;
+	  NEXT;
+	OP(0131)		// Jump to subroutine
+	  WR(y, m->acc = ((0130ULL << 30) | ((m->ip & 07777ULL) << 12)));
+	  m->ip = x.address;
+	  ENTER_BLOCK;
+	  JIT_TRY;
+	  NEXT;
+	OP(0132)		// Jump if positive
+	  if (wsign(m->r2) >= 0)
+	    m->ip = x.address;
+	  else
+	    m->ip = y.address;
+	  ENTER_BLOCK;
+	  JIT_TRY;
+	  NEXT;
+	OP(0133)		// Jump if overflow
+	  // Since we always trap on overflow, this instruction always jumps to the 1st address
+	  m->ip = x.address;
+	  ENTER_BLOCK;
+	  JIT_TRY;
+	  NEXT;
+	OP(0134)		// Jump if zero
+	  if (!wabs(m->r2))
+	    m->ip = y.address;
+	  else
+	    m->ip = x.address;
+	  ENTER_BLOCK;
+	  JIT_TRY;
+	  NEXT;
+	OP(0135)		// Jump if key pressed
+	  // No keys are ever pressed, so always jump to 2nd
+	  m->ip = y.address;
+	  ENTER_BLOCK;
+	  JIT_TRY;
+	  NEXT;
+	OP(0136)		// Interrupt masking
+	  return notimp(m);
+	OP(0137)		// Used only when reading from tape
+	  return notimp(m);
+	OPS(0140, 0147)		// I/O
+	  return notimp(m);
+	OPS(0150, 0154)		// I/O
+	  return notimp(m);
+	OPS(0160, 0161)		// I/O
+	  return notimp(m);
+	OP(0162)		// Printing
+	  m->host = HOST_PRINT;
+	  if (print_ins(m, x.address, y))
+	    return m->status;
+	  m->host = ENGINE_HOST;
+	  ENTER_BLOCK;
+	  JIT_TRY;
+	  NEXT;
+	OP(0163)		// I/O
+	  return notimp(m);
+	AOP(0170,		// FIX multiplication, bottom part
+	  c = fix_mul_low(a, b);
+	  if (c == OVERFLOW_WORD)
+	    return over(m);
+	  m->acc = c)
+	AOP(0171,		// Modulo
+	  aa = wabs(a);
+	  bb = wabs(b);
+	  if (!bb)
+	    return over(m);
+	  cc = aa % bb;
+	  if (wsign(b) < 0)
+	    cc = -cc;
+	  m->acc = wfromll(cc))
+	OP(0172)		// Add exponents
+	  a = m->r1 = RD(xi);
+	  b = RD(yi);
+	  i = wexp(a) + wexp(b);
+	  if (i < -63 || i > 63)
+	    return over(m);
+	  m->acc = wputexp(b, i);
+	  WR(yi, m->acc);
+	  NEXT;
+	OP(0173)		// Sub exponents
+	  a = m->r1 = RD(xi);
+	  b = RD(yi);
+	  i = wexp(b) - wexp(a);
+	  if (i < -63 || i > 63)
+	    return over(m);
+	  m->acc = wputexp(b, i);
+	  WR(yi, m->acc);
+	  NEXT;
+	OP(0174)		// Addition in one's complement
+	  a = m->r1 = RD(xi);
+	  b = RD(yi);
+	  c = a + b;
+	  if (c > VAL_MASK)
+	    c = c - VAL_MASK;
+	  WR(yi, c);
+	  // XXX: The effect on the accumulator is undocumented, but likely to be as follows:
+	  m->acc = c;
+	  NEXT;
+	OP(0175)		// Normalization
+	  a = m->r1 = RD(xi);
+	  if (!wabs(a))
+	    {
+	      WR(yi, 0);
+	      loc yinc = { yi.block, (yi.address+1) & 07777 };
+	      WR(yinc, 0);
+	      m->acc = 0;
+	    }
+	  else
+	    {
+	      i = 0;
+	      m->acc = a & SIGN_MASK;
+	      a &= VAL_MASK;
+	      while (!(a & (SIGN_MASK >> 1)))
+		{
+		  a <<= 1;
+		  i++;
+		}
+	      m->acc |= a;
+	      WR(yi, m->acc);
+	      loc yinc = { yi.block, (yi.address+1) & 07777 };
+	      WR(yinc, i);
+	    }
+	  NEXT;
+	OP(0176)		// Population count
+	  a = m->r1 = RD(xi);
+	  cc = 0;
+	  for (int i=0; i<36; i++)
+	    if (a & (1ULL << i))
+	      cc++;
+	  // XXX: Guessing that acc gets a copy of the result
+	  m->acc = wfromll(cc);
+	  WR(yi, m->acc);
+	  NEXT;
+#ifdef ENABLE_THREADED_DISPATCH
+	/* Superinstructions: the first instruction, then the next one (or the superinstruction starting there) if it is still there */
+	FUSED_AOP(FUSED_ADD_XOR, 011, 005, 005,
+	  ASTORE_INT(wtoll(a) + wtoll(b)))
+	FUSED_AOP(FUSED_ADD_XOR_LOOP, 011, 005, FUSED_XOR_LOOP,
+	  ASTORE_INT(wtoll(a) + wtoll(b)))
+	FUSED_AOP(FUSED_XOR_LOOP, 005, 0120, 0120,
+	  ASTORE(a^b))
+	FUSED_AOP(FUSED_SUB_LOOP, 021, 0120, 0120,
+	  ASTORE_INT(wtoll(a) - wtoll(b)))
+	FUSED_AOP(FUSED_FPSUB_LOOP, 054, 0120, 0120,
+	  ASTORE_CHECK(fp_addsub(a, b, 1)))
+	FUSED(FUSED_MOVE_ADD, 011, 011,
+	  WR(yi, m->r1 = m->acc = RD(xi)))
+	FUSED(FUSED_MOVE_ADD_XOR_LOOP, 011, FUSED_ADD_XOR_LOOP,
+	  WR(yi, m->r1 = m->acc = RD(xi)))
+	FUSED_AOP(FUSED_SUB_JPOS, 020, 0132, 0132,
+	  ASTORE_INT(wtoll(a) - wtoll(b)))
+	FUSED_AOP(FUSED_SUB_JZERO, 020, 0134, 0134,
+	  ASTORE_INT(wtoll(a) - wtoll(b)))
+#endif
+	OP_ILLEGAL
+	  return noins(m);
+#ifndef ENABLE_THREADED_DISPATCH
+	}
+
+      trace_regs(m, TRACING);
+      if (STEP)
+	return MINSK_RUNNING;
+    }
+#endif
+}
+
+#undef ENGINE
+#undef TRACING
+#undef BLOCKS
+#undef PROFILE
+#undef STEP
+#undef MINSK22
@@ -0,0 +1,3950 @@
+/*
+ *	Minsk-2 Emulator -- The Machine
+ *
+ *	(c) 2010 Martin Mares <mj@ucw.cz>
+ */
+
+/*
+ * Things that are not implemented:
+ *
+ *	- rounding modes
+ *	- exact behavior of accumulator/R1/R2 (the manual lacks details)
+ *	- exact behavior of negative zero
+ *	- I/O instructions for devices that are not emulated (paper tape
+ *	  reader and puncher, card reader and puncher, magnetic tape unit)
+ */
+
+#define _GNU_SOURCE
+#define UNUSED __attribute__((unused))
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+#ifndef NO_THREADED_DISPATCH
+#define ENABLE_THREADED_DISPATCH
+#endif
+#if defined(__x86_64__) && !defined(NO_JIT)
+#define ENABLE_JIT
+#endif
+
+#include "minsk.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <endian.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+typedef minsk_word word;
+
+#define  MEM_SIZE 4096
+#define WORD_MASK 01777777777777ULL
+#define SIGN_MASK 01000000000000ULL
+#define  VAL_MASK 00777777777777ULL
+
+typedef struct loc
+{
+  int block;
+  int address;
+} loc;
+
+static int wsign(word w)
+{
+  return (w & SIGN_MASK) ? -1 : 1;
+}
+
+static word wabs(word w)
+{
+  return w & VAL_MASK;
+}
+
+#define WF(w) (wsign(w) < 0 ? '-' : '+'), wabs(w)
+#define LF(a) ((a).block), ((a).address)
+
+static long long wtoll(word w)
+{
+  if (wsign(w) < 0)
+    return -wabs(w);
+  else
+    return wabs(w);
+}
+
+static word wfromll(long long x)
+{
+  word w = ((x < 0) ? -x : x) & VAL_MASK;
+  if (x < 0)
+    w |= SIGN_MASK;
+  return w;
+}
+
+static int int_in_range(long long x)
+{
+  return (x >= -(long long)VAL_MASK && x <= (long long)VAL_MASK);
+}
+
+typedef unsigned __int128 wide;
+
+#define OVERFLOW_WORD (~(word)0)	// Returned instead of a word if the result does not fit
+
+/*
+ *  Fixed-point numbers are fractions with 36 bits after the binary point.
+ *  Products and quotients are computed exactly and truncated towards zero;
+ *  a zero result is never negative.
+ */
+
+static word fix_mul(word a, word b)
+{
+  word p = ((wide) wabs(a) * wabs(b)) >> 36;
+  return p ? p | ((a ^ b) & SIGN_MASK) : 0;
+}
+
+static word fix_div(word a, word b)
+{
+  if (wabs(a) >= wabs(b))
+    return OVERFLOW_WORD;
+  // The 72-bit dividend in two steps, both within 64 bits
+  word q = (wabs(a) << 27) / wabs(b), r = (wabs(a) << 27) % wabs(b);
+  q = (q << 9) + (r << 9) / wabs(b);
+  return q ? q | ((a ^ b) & SIGN_MASK) : 0;
+}
+
+/*
+ *  The bottom part of the product overflows if the product of the fractions
+ *  is at least 0.1 / 2^32 (as a double), which is 109951162777.6 * 2^-72.
+ *  Negative products never overflow.
+ */
+#define FIX_MUL_LOW_LIMIT 109951162778ULL
+
+static word fix_mul_low(word a, word b)
+{
+  wide p = (wide) wabs(a) * wabs(b);
+  if (!((a ^ b) & SIGN_MASK) && p >= FIX_MUL_LOW_LIMIT)
+    return OVERFLOW_WORD;
+  // XXX: What should be the sign? The book does not define that.
+  return (word) p & VAL_MASK;
+}
+
+static int wexp(word w)
+{
+  int exp = w & 077;
+  return (w & 0100 ? -exp : exp);
+}
+
+static word wputexp(word w, int exp)
+{
+  return ((w & ~(word)0177) | ((exp < 0) ? 0100 | (-exp) : exp));
+}
+
+static int wmanti(word w)
+{
+  return ((w >> 8) & ((1 << 28) - 1));
+}
+
+/*
+ *  Floating-point arithmetic works on the words with integer operations only.
+ *  The results are those the emulator always gave when it computed in double
+ *  precision: the exact result is rounded to 53 bits (to nearest, ties to
+ *  even), then its mantissa is truncated to 28 bits. The signs of the operands
+ *  have always been ignored, so the operands are never negative.
+ */
+
+static int fp_bits(wide x)
+{
+  unsigned long long hi = x >> 64, lo = x;
+  return hi ? 128 - __builtin_clzll(hi) : lo ? 64 - __builtin_clzll(lo) : 0;
+}
+
+// Convert (sig + sticky bits below it) * 2^exp to a word, or OVERFLOW_WORD
+static word fp_pack(wide sig, int exp, int sticky, int negative)
+{
+  if (!sig)
+    return 0;
+
+  // Round to a 53-bit mantissa
+  int n = fp_bits(sig);
+  unsigned long long keep;
+  if (n > 53)
+    {
+      int drop = n - 53;
+      wide rest = sig & (((wide) 1 << drop) - 1);
+      wide half = (wide) 1 << (drop - 1);
+      keep = sig >> drop;
+      if (rest > half || rest == half && (sticky || (keep & 1)))
+	keep++;
+      exp += drop;
+      if (keep >> 53)
+	{
+	  keep >>= 1;
+	  exp++;
+	}
+    }
+  else
+    {
+      keep = (unsigned long long) sig << (53 - n);
+      exp -= 53 - n;
+    }
+
+  // The value is keep * 2^exp = 0.mantissa * 2^e
+  int e = exp + 53;
+  if (e > 63 || e == 63 && keep > ((1ULL << 28) - 1) << 25)
+    return OVERFLOW_WORD;
+  word mm = keep >> 25;
+  if (e < -63)
+    {
+      if (e < -91)
+	mm = 0, e = 0;
+      else
+	{
+	  mm >>= -e - 63;
+	  e = -63;
+	}
+    }
+
+  word w = negative ? SIGN_MASK : 0;
+  w |= mm << 8;
+  return wputexp(w, e);
+}
+
+static word fp_addsub(word a, word b, int sub)
+{
+  int ea = wexp(a), eb = wexp(b);
+  wide va = wmanti(a), vb = wmanti(b);
+  int exp;
+
+  // Align the mantissas; an operand far below the other one only matters for rounding
+  if (ea >= eb)
+    {
+      if (ea - eb > 90 && va)
+	{
+	  va <<= 90;
+	  vb = !!vb;
+	  exp = ea - 28 - 90;
+	}
+      else
+	{
+	  va <<= ea - eb;
+	  exp = eb - 28;
+	}
+    }
+  else
+    {
+      if (eb - ea > 90 && vb)
+	{
+	  vb <<= 90;
+	  va = !!va;
+	  exp = eb - 28 - 90;
+	}
+      else
+	{
+	  vb <<= eb - ea;
+	  exp = ea - 28;
+	}
+    }
+
+  if (!sub)
+    return fp_pack(va + vb, exp, 0, 0);
+  else if (va >= vb)
+    return fp_pack(va - vb, exp, 0, 0);
+  else
+    return fp_pack(vb - va, exp, 0, 1);
+}
+
+static word fp_mul(word a, word b)
+{
+  return fp_pack((unsigned long long) wmanti(a) * wmanti(b), wexp(a) + wexp(b) - 56, 0, 0);
+}
+
+// Division by a zero mantissa overflows
+static word fp_div(word a, word b)
+{
+  unsigned long long ma = wmanti(a), mb = wmanti(b);
+  if (!mb)
+    return OVERFLOW_WORD;
+  if (!ma)
+    return 0;
+
+  // Long division of the mantissa of a moved to the top of 64 bits, then 32 more bits of the quotient
+  int shift = __builtin_clzll(ma);
+  ma <<= shift;
+  unsigned long long q = ma / mb, r = ma % mb;
+  unsigned long long q2 = (r << 32) / mb, r2 = (r << 32) % mb;
+  return fp_pack(((wide) q << 32) | q2, wexp(a) - wexp(b) - shift - 32, r2 != 0, 0);
+}
+
+/*
+ *  The flight recorder remembers the last few executed instructions in a
+ *  ring buffer: the instruction, its operands after indexing and the
+ *  registers before it was executed. Instructions run as translated code
+ *  are not recorded one by one, just a mark for every translated block.
+ */
+
+typedef struct record
+{
+  word w;
+  word acc, r1;
+  unsigned short ip;
+  unsigned short x, y;
+  unsigned char xb, yb;
+  unsigned char jit;			// Mark for a translated block
+} record;
+
+struct profile;
+struct sampler;
+
+#ifdef ENABLE_JIT
+struct jit;
+struct jit_state;
+typedef int (*jit_code)(struct jit_state *s);
+#endif
+
+/*
+ *  Predecoded instructions. Every cell of block 0 has a slot which fetch()
+ *  fills when it first executes the cell; mem_wr() drops it whenever the cell
+ *  is written, so self-modifying programs see their changes.
+ */
+typedef struct decoded
+{
+  int valid;
+  int op;				// Operation code (0200 if not valid on this machine)
+  int fop;				// The same or a superinstruction starting here (see fuse())
+  int ix;				// Index register
+  int indexed;				// Operands are indexed (the loop instruction uses ix differently)
+  int ends_block;			// Instruction can leave the straight-line flow
+  int idiom;				// Loop which can run as a bulk operation (see bulk_loop())
+  loc x, y;				// Operands
+  int block_len;			// Length of the basic block starting here...
+  unsigned int block_gen;		// ... valid if equal to code_gen
+#ifdef ENABLE_JIT
+  jit_code jit;				// Translation of the block starting here...
+  unsigned int jit_gen;			// ... valid if equal to code_gen
+  int heat;				// Number of jumps here before translation
+#endif
+} decoded;
+
+// State of the machine at a block entry, to find out whether it repeats (see loop_check())
+struct loop_anchor {
+  int ip;
+  word acc, r1, r2;
+  unsigned long long effects;
+  int steps, window;			// Block entries since it was taken, and when to take the next one
+  unsigned long long quiet;		// Effects at the last block entry
+};
+
+// Native code translated ahead of time (see minsk_translate())
+struct aot {
+  const struct minsk_translation *t;
+  unsigned char watch[MEM_SIZE];	// Cells holding code, whose changes the native code reports
+  unsigned char stale[MEM_SIZE];	// Entries of blocks which cannot run natively (AOT_xxx)
+};
+
+#define AOT_CHANGED 1			// The code changed
+#define AOT_NO_RETURN 2			// The block ends with a return address which holds no jump now
+
+static void aot_changed(struct minsk_machine *m, int addr, word val);
+
+// What the emulator is doing, as seen by the sampling profiler
+enum host_state {
+  HOST_INTERP,
+  HOST_TRACE,
+  HOST_PROFILE,
+  HOST_JIT,
+  HOST_TRANSLATE,
+  HOST_PRINT,
+  HOST_MAX,
+};
+
+/*
+ *  The whole state of a machine. Nothing else in the emulator is
+ *  writable, so machines are independent of each other.
+ */
+
+struct minsk_machine
+{
+  int memblocks;
+  word *mem;				// All blocks, cell i of block b at b*MEM_SIZE + i
+  decoded *icache;
+  unsigned int code_gen;		// Bumped whenever a decoded instruction changes
+  int block_end;			// Last instruction of the block being executed
+
+  word acc;
+  word r1, r2;
+  int ip;
+  int prev_ip;
+
+  int trace;
+  record *rec;				// Flight recorder: ring buffer of rec_mask+1 records...
+  unsigned int rec_mask;
+  unsigned long long rec_pos;		// ... and the number of records made so far
+  struct profile *prof;			// Profile (if profiling)
+  struct sampler *sampler;		// Sampling profiler (if sampling)...
+  volatile sig_atomic_t host;		// ... and what the emulator is doing (enum host_state)
+  FILE *btrace;				// Binary trace: file, records not written yet, last registers
+  int btrace_n;
+  word btrace_regs[3];
+  int cpu_limit, print_limit;		// Quotas as set...
+  int cpu_quota, print_quota;		// ... and what remains of them
+  unsigned long long effects;		// Memory cells changed and print instructions executed
+  int loop_check;			// Stop in infinite loops (see loop_check())...
+  struct loop_anchor loop;		// ... and the state they are compared with
+  FILE *out;
+  unsigned char linebuf[128];		// Printer: glyphs on the line
+  int flush_lines;			// Flush output every flush_lines lines (0 = when stopped)
+  int unflushed;
+
+  enum minsk_status status;
+  int lino;				// Parse errors: line number and message
+  char *parse_msg[2];
+#ifdef ENABLE_JIT
+  struct jit *jit;
+#endif
+  struct aot *aot;
+  struct minsk_trace_record btrace_buf[256];
+};
+
+static ALWAYS_INLINE void record_ins(struct minsk_machine *m, int ip, loc x, loc y)
+{
+  record *r = &m->rec[m->rec_pos++ & m->rec_mask];
+  r->w = m->mem[ip];
+  r->acc = m->acc;
+  r->r1 = m->r1;
+  r->ip = ip;
+  r->x = x.address;
+  r->xb = x.block;
+  r->y = y.address;
+  r->yb = y.block;
+  r->jit = 0;
+}
+
+/*
+ *  Binary traces (see minsk.h). The engine records them if its trace
+ *  level is TRACE_BINARY; records are collected in the machine and
+ *  written in batches.
+ */
+
+#define TRACE_BINARY -1
+#define TRACE_LEVEL(m) ((m)->btrace ? TRACE_BINARY : (m)->trace)
+
+static void btrace_flush(struct minsk_machine *m)
+{
+  if (m->btrace_n)
+    fwrite(m->btrace_buf, sizeof(struct minsk_trace_record), m->btrace_n, m->btrace);
+  m->btrace_n = 0;
+}
+
+static ALWAYS_INLINE void btrace(struct minsk_machine *m, int type, loc a, loc b, int reg, word val)
+{
+  if (m->btrace_n == (int) (sizeof(m->btrace_buf) / sizeof(m->btrace_buf[0])))
+    btrace_flush(m);
+  struct minsk_trace_record *r = &m->btrace_buf[m->btrace_n++];
+  r->type = type;
+  r->a_block = a.block;
+  r->b_block = b.block;
+  r->reg = reg;
+  r->a_address = htole16(a.address);
+  r->b_address = htole16(b.address);
+  r->val = htole64(val);
+}
+
+static ALWAYS_INLINE void btrace_mem(struct minsk_machine *m, int type, loc addr, word val)
+{
+  loc none = { 0, 0 };
+  btrace(m, type, addr, none, 0, val);
+}
+
+/*
+ *  Memory accesses. The interpreter calls mem_rd() and mem_wr() with
+ *  the trace level known at compile time, the rest of the emulator
+ *  uses rd() and wr(). Unless minsk22 is set, the block number is
+ *  ignored: on a Minsk-2, all operands are in block 0.
+ */
+
+static ALWAYS_INLINE int mem_index(loc addr, const int minsk22)
+{
+  return minsk22 ? addr.block * MEM_SIZE + addr.address : addr.address;
+}
+
+static ALWAYS_INLINE word mem_rd(struct minsk_machine *m, loc addr, const int tracing, const int minsk22)
+{
+  // Cell 0 reads as zero, but a mask is cheaper than a branch
+  word val = m->mem[mem_index(addr, minsk22)] & -(word) (addr.address != 0);
+  if (tracing > 2)
+    fprintf(m->out, "\tRD %d:%04o = %c%012llo\n", LF(addr), WF(val));
+  else if (tracing == TRACE_BINARY)
+    btrace_mem(m, MINSK_TR_RD, addr, val);
+  return val;
+}
+
+static ALWAYS_INLINE void mem_wr(struct minsk_machine *m, loc addr, word val, const int tracing, const int minsk22)
+{
+  assert(!(val & ~(WORD_MASK)));
+  if (tracing > 2)
+    fprintf(m->out, "\tWR %d:%04o = %c%012llo\n", LF(addr), WF(val));
+  else if (tracing == TRACE_BINARY)
+    btrace_mem(m, MINSK_TR_WR, addr, val);
+  word *cell = &m->mem[mem_index(addr, minsk22)];
+  if (*cell != val)
+    {
+      m->effects++;
+      if (!(minsk22 && addr.block))
+	{
+	  if (m->icache[addr.address].valid)
+	    {
+	      m->icache[addr.address].valid = 0;
+	      m->code_gen++;
+	    }
+	  if (m->aot)
+	    aot_changed(m, addr.address, val);
+	}
+    }
+  *cell = val;
+}
+
+static word rd(struct minsk_machine *m, loc addr)
+{
+  return mem_rd(m, addr, TRACE_LEVEL(m), 1);
+}
+
+static void wr(struct minsk_machine *m, loc addr, word val)
+{
+  mem_wr(m, addr, val, TRACE_LEVEL(m), 1);
+}
+
+static enum minsk_status parse_error(struct minsk_machine *m, char *russian_msg, char *english_msg)
+{
+  m->parse_msg[0] = russian_msg;
+  m->parse_msg[1] = english_msg;
+  return m->status = MINSK_PARSE_ERROR;
+}
+
+/*
+ *  Octal numbers are converted 8 digits at a time: after checking that
+ *  all bytes are ASCII '0' to '7', neighbouring digits are merged into
+ *  6-bit, 12-bit and finally 24-bit groups in a 64-bit register.
+ */
+
+static int64_t octal8(const char *digits)
+{
+  uint64_t x;
+  memcpy(&x, digits, 8);
+  x = le64toh(x);			// The first (most significant) digit in the lowest byte
+  if ((x & 0xf8f8f8f8f8f8f8f8ULL) != 0x3030303030303030ULL)
+    return -1;
+  x &= 0x0707070707070707ULL;
+  x = ((x << 3) + (x >> 8)) & 0x00ff00ff00ff00ffULL;
+  x = ((x << 6) + (x >> 16)) & 0x0000ffff0000ffffULL;
+  x = ((x << 12) + (x >> 32)) & 0xffffffffULL;
+  return x;
+}
+
+/*
+ *  The parser reads the input to a buffer of its own and looks at the lines
+ *  there, copying only those which cross the end of the buffer. If the stream
+ *  has a file descriptor, the buffer is refilled by read(), which returns
+ *  whatever is available, so the parser can be used on interactive connections,
+ *  too. Streams without a descriptor (e.g., fmemopen()) are read by fread().
+ */
+
+#define LINE_MAX_LEN 78			// Without the newline; comments can be longer
+#define IN_BUF_SIZE 65536
+
+struct in_buf {
+  FILE *in;
+  int fd;				// -1 if the stream has no descriptor
+  char *pos, *end;			// The unparsed part of buf
+  char buf[IN_BUF_SIZE];
+};
+
+static void in_init(struct in_buf *b, FILE *in)
+{
+  b->in = in;
+  b->fd = fileno(in);
+  b->pos = b->end = b->buf;
+}
+
+static int in_buffer(struct in_buf *b, char **start, char **end)
+{
+  if (b->pos >= b->end)
+    {
+      ssize_t n;
+      if (b->fd >= 0)
+	{
+	  while ((n = read(b->fd, b->buf, IN_BUF_SIZE)) < 0 && errno == EINTR)
+	    ;
+	}
+      else
+	n = fread(b->buf, 1, IN_BUF_SIZE, b->in);
+      if (n <= 0)
+	return 0;
+      b->pos = b->buf;
+      b->end = b->buf + n;
+    }
+  *start = b->pos;
+  *end = b->end;
+  return 1;
+}
+
+static void in_consume(struct in_buf *b, char *upto)
+{
+  b->pos = upto;
+}
+
+/*
+ *  Get the next line, without the newline. Returns its length (the copy
+ *  keeps just the first LINE_MAX_LEN+1 characters of a longer line) or
+ *  -1 at the end of input. If the input ends without a newline, *eof is set.
+ */
+static int get_line(struct in_buf *in, char *copy, char **line, int *eof)
+{
+  char *p, *e, *nl;
+  if (!in_buffer(in, &p, &e))
+    return -1;
+
+  if (nl = memchr(p, '\n', e - p))
+    {
+      in_consume(in, nl + 1);
+      *line = p;
+      return nl - p;
+    }
+
+  int len = 0;
+  for (;;)
+    {
+      nl = memchr(p, '\n', e - p);
+      int n = (nl ? nl : e) - p;
+      if (len <= LINE_MAX_LEN)
+	memcpy(copy + len, p, (n < LINE_MAX_LEN+1 - len) ? n : LINE_MAX_LEN+1 - len);
+      len += n;
+      in_consume(in, p + n + !!nl);
+      if (nl)
+	break;
+      if (!in_buffer(in, &p, &e))
+	{
+	  *eof = 1;
+	  break;
+	}
+    }
+  *line = copy;
+  return len;
+}
+
+// If loaded is not NULL, it gets the cells of block 0 which the program sets
+static enum minsk_status parse_in(struct minsk_machine *m, FILE *in, unsigned char *loaded)
+{
+  char copy[LINE_MAX_LEN+1];
+  loc addr = { 0, 0 };
+  enum minsk_status status = MINSK_RUNNING;
+  int len, eof = 0;
+  char *c;
+
+  struct in_buf *b = malloc(sizeof(*b));
+  if (!b)
+    return parse_error(m, "Не хватает памяти", "Out of memory");
+  in_init(b, in);
+  while ((len = get_line(b, copy, &c, &eof)) >= 0)
+    {
+      m->lino++;
+      if (len && c[0] == ';')
+	continue;
+      if (len > LINE_MAX_LEN || eof || memchr(c, 0, len))
+	{
+	  status = parse_error(m, "Строка слишком долгая", "Line too long");
+	  break;
+	}
+      char *end = c + len;
+      if (end > c && end[-1] == '\r')
+	end--;
+
+      if (c == end)
+	continue;
+
+      if (c[0] == '.')
+	break;
+
+      if (c[0] == '@')
+	{
+	  c++;
+	  addr.address = 0;
+	  for (int i=0; i<4; i++)
+	    {
+	      while (c < end && *c == ' ')
+		c++;
+	      if (c < end && *c >= '0' && *c <= '7')
+		addr.address = 8*addr.address + *c++ - '0';
+	      else
+		{
+		  status = parse_error(m, "Плохая цифра", "Invalid number");
+		  goto done;
+		}
+	    }
+	  while (c < end && *c == ' ')
+	    c++;
+	  if (c < end)
+	    {
+	      status = parse_error(m, "Адрес слишком долгий", "Address too long");
+	      break;
+	    }
+	  continue;
+	}
+
+      word w = 0;
+      if (*c == '-')
+	w = 1;
+      else if (*c != '+')
+	{
+	  status = parse_error(m, "Плохой знак", "Invalid sign");
+	  break;
+	}
+      c++;
+
+      // Gather the 12 digits after 4 zeroes, so that they split to two groups of 8
+      char digits[16] = "0000";
+      int nd = 4;
+      if (end - c == 15 && c[2] == ' ' && c[5] == ' ' && c[10] == ' ')
+	{
+	  // The usual layout "dd dd dddd dddd"
+	  memcpy(digits + 4, c, 2);
+	  memcpy(digits + 6, c + 3, 2);
+	  memcpy(digits + 8, c + 6, 4);
+	  memcpy(digits + 12, c + 11, 4);
+	  nd = 16;
+	  c = end;
+	}
+      else
+	while (nd < 16)
+	  {
+	    while (c < end && *c == ' ')
+	      c++;
+	    if (c == end)
+	      break;
+	    digits[nd++] = *c++;
+	  }
+      int64_t hi = octal8(digits), lo = octal8(digits + 8);
+      if (nd < 16 || hi < 0 || lo < 0)
+	{
+	  status = parse_error(m, "Плохая цифра", "Invalid number");
+	  break;
+	}
+      w = (w << 36) | (hi << 24) | lo;
+
+      while (c < end && *c == ' ')
+	c++;
+      if (c < end)
+	{
+	  status = parse_error(m, "Номер слишком долгий", "Number too long");
+	  break;
+	}
+      wr(m, addr, w);
+      if (loaded)
+	loaded[addr.address] = 1;
+      addr.address = (addr.address+1) & 07777;
+    }
+done:
+  free(b);
+  return status;
+}
+
+/*** Memory images ***/
+
+/*
+ *  A memory image is a loaded program in binary form, so that it can be
+ *  mapped and copied to the memory without any parsing. All fields are
+ *  little-endian and every part is aligned to 8 bytes:
+ *
+ *	header		"MINSKIMG", version, number of ranges
+ *	range		block, address, number of words, then the words
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define IMAGE_MAGIC "MINSKIMG"
+#define IMAGE_VERSION 1
+
+struct image_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t nranges;
+};
+
+struct image_range
+{
+  uint16_t block;
+  uint16_t address;
+  uint16_t count;
+  uint16_t zero;
+};
+
+static enum minsk_status bad_image(struct minsk_machine *m)
+{
+  return parse_error(m, "Плохой образ памяти", "Invalid memory image");
+}
+
+static enum minsk_status load_image(struct minsk_machine *m, const unsigned char *img, size_t len)
+{
+  const struct image_header *h = (const struct image_header *) img;
+  if (len < sizeof(*h) || memcmp(h->magic, IMAGE_MAGIC, 8) || le32toh(h->version) != IMAGE_VERSION)
+    return bad_image(m);
+
+  size_t pos = sizeof(*h);
+  for (uint32_t i = le32toh(h->nranges); i; i--)
+    {
+      const struct image_range *r = (const struct image_range *) (img + pos);
+      if (len - pos < sizeof(*r))
+	return bad_image(m);
+      int block = le16toh(r->block);
+      int addr = le16toh(r->address);
+      int count = le16toh(r->count);
+      pos += sizeof(*r);
+      if (block >= m->memblocks || addr + count > MEM_SIZE || (len - pos) / sizeof(word) < (size_t) count)
+	return bad_image(m);
+
+      const uint64_t *src = (const uint64_t *) (img + pos);
+      word *dst = &m->mem[block * MEM_SIZE + addr];
+      word bad = 0;
+      for (int j=0; j<count; j++)
+	{
+	  dst[j] = le64toh(src[j]);
+	  bad |= dst[j];
+	}
+      pos += count * sizeof(word);
+      if (bad & ~WORD_MASK)
+	return bad_image(m);
+
+      // Unlike wr(), we do not compare the values, so just forget everything decoded there
+      if (!block)
+	{
+	  memset(&m->icache[addr], 0, count * sizeof(decoded));
+	  m->code_gen++;
+	}
+    }
+  return MINSK_RUNNING;
+}
+
+static enum minsk_status read_image(struct minsk_machine *m, int fd)
+{
+  // If the image cannot be mapped (e.g., it comes from a pipe), read it to memory
+  unsigned char *buf = NULL;
+  size_t len = 0, size = 0;
+  for (;;)
+    {
+      if (len == size)
+	{
+	  size = size ? 2*size : 65536;
+	  unsigned char *nbuf = realloc(buf, size);
+	  if (!nbuf)
+	    break;
+	  buf = nbuf;
+	}
+      ssize_t n = read(fd, buf + len, size - len);
+      if (n <= 0)
+	{
+	  enum minsk_status st = n ? bad_image(m) : load_image(m, buf, len);
+	  free(buf);
+	  return st;
+	}
+      len += n;
+    }
+  free(buf);
+  return bad_image(m);
+}
+
+static void put_image(FILE *out, const void *data, size_t len)
+{
+  fwrite(data, 1, len, out);
+}
+
+static enum minsk_status convert(struct minsk_machine *m, FILE *in, FILE *out)
+{
+  unsigned char loaded[MEM_SIZE] = { 0 };
+  if (parse_in(m, in, loaded))
+    return m->status;
+
+  // Every run of loaded cells becomes a range
+  uint32_t nranges = 0;
+  for (int i=0; i<MEM_SIZE; i++)
+    if (loaded[i] && (!i || !loaded[i-1]))
+      nranges++;
+  struct image_header h = { .magic = IMAGE_MAGIC, .version = htole32(IMAGE_VERSION), .nranges = htole32(nranges) };
+  put_image(out, &h, sizeof(h));
+
+  for (int i=0; i<MEM_SIZE; )
+    {
+      if (!loaded[i])
+	{
+	  i++;
+	  continue;
+	}
+      int start = i;
+      while (i < MEM_SIZE && loaded[i])
+	i++;
+      struct image_range r = { .block = 0, .address = htole16(start), .count = htole16(i - start) };
+      put_image(out, &r, sizeof(r));
+      for (int j=start; j<i; j++)
+	{
+	  uint64_t w = htole64(m->mem[j]);
+	  put_image(out, &w, sizeof(w));
+	}
+    }
+  return MINSK_RUNNING;
+}
+
+static char * const stop_reasons[][2] = {
+  [MINSK_RUNNING] =		{ "Машина работает", "Running" },
+  [MINSK_HALTED] =		{ "Останов машины", "Halted" },
+  [MINSK_OVERFLOW] =		{ "Аварийный останов", "Overflow" },
+  [MINSK_NOT_IMPLEMENTED] =	{ "Устройство разбитое", "Not implemented" },
+  [MINSK_ILLEGAL] =		{ "Эту команду не знаю", "Illegal instruction" },
+  [MINSK_CPU_QUOTA] =		{ "Тайм-аут", "CPU quota exceeded" },
+  [MINSK_OUT_OF_PAPER] =	{ "Бумага дошла - нужно ехать в Сибирь про новую", "Out of paper" },
+  [MINSK_PARSE_ERROR] =		{ "Ошибка входа", "Parse error" },
+  [MINSK_INFINITE_LOOP] =	{ "Вечный цикл", "Infinite loop" },
+};
+
+/*
+ *  Stopping the machine only records the reason. Whoever finds out that
+ *  the machine stopped returns the status to its caller, up to minsk_run().
+ */
+
+static enum minsk_status stop(struct minsk_machine *m, enum minsk_status status)
+{
+  return m->status = status;
+}
+
+static enum minsk_status over(struct minsk_machine *m)
+{
+  return stop(m, MINSK_OVERFLOW);
+}
+
+static enum minsk_status notimp(struct minsk_machine *m)
+{
+  m->acc = m->mem[m->prev_ip];
+  return stop(m, MINSK_NOT_IMPLEMENTED);
+}
+
+static enum minsk_status noins(struct minsk_machine *m)
+{
+  m->acc = m->mem[m->prev_ip];
+  return stop(m, MINSK_ILLEGAL);
+}
+
+static const uint16_t russian_chars[64] = {
+	'0',	'1',	'2',	'3',	'4',	'5',	'6',	'7',	// 0x
+	'8',	'9',	'+',	'-',	'/',	',',	'.',	' ',	// 1x
+	0x2169,	'^',	'(',	')',	0x00d7,	'=',	';',	'[',	// 2x
+	']',	'*',	'`',	'\'',	0x2260,	'<',	'>',	':',	// 3x
+	0x410,	0x411,	0x412,	0x413,	0x414,	0x415,	0x416,	0x417,	// 4x
+	0x418,	0x419,	0x41a,	0x41b,	0x41c,	0x41d,	0x41e,	0x41f,	// 5x
+	0x420,	0x421,	0x422,	0x423,	0x424,	0x425,	0x426,	0x427,	// 6x
+	0x428,	0x429,	0x42b,	0x42c,	0x42d,	0x42e,	0x42f,	0x2013	// 7x
+};
+
+static const uint16_t latin_chars[64] = {
+	'0',	'1',	'2',	'3',	'4',	'5',	'6',	'7',	// 0x
+	'8',	'9',	'+',	'-',	'/',	',',	'.',	' ',	// 1x
+	0x2169,	'^',	'(',	')',	0x00d7,	'=',	';',	'[',	// 2x
+	']',	'*',	'`',	'\'',	0x2260,	'<',	'>',	':',	// 3x
+	'A',	'B',	'W',	'G',	'D',	'E',	'V',	'Z',	// 4x
+	'I',	'J',	'K',	'L',	'M',	'N',	'O',	'P',	// 5x
+	'R',	'S',	'T',	'U',	'F',	'H',	'C',	' ',	// 6x
+	' ',	' ',	'Y',	'X',	' ',	' ',	'Q',	0x2013	// 7x
+};
+
+/*
+ *  The printer. Its line buffer holds glyph numbers: 0 for an empty
+ *  position, 1 to 64 for russian_chars and 65 to 128 for latin_chars
+ *  (digits, signs and the space are taken from the Russian set, the hex
+ *  digits A to F from the Latin one). UTF-8 forms of all glyphs are
+ *  prepared once, so a line is rendered by copying them to a buffer.
+ */
+
+#define NUM_GLYPHS 129
+#define G_RUS(c) (1 + (c))
+#define G_LAT(c) (65 + (c))
+
+static struct glyph {
+  unsigned char len;
+  char utf8[3];
+} glyphs[NUM_GLYPHS];
+
+static void __attribute__((constructor)) init_glyphs(void)
+{
+  for (int g=0; g<NUM_GLYPHS; g++)
+    {
+      int ch = !g ? ' ' : (g <= 64) ? russian_chars[g-1] : latin_chars[g-65];
+      char *u = glyphs[g].utf8;
+      if (ch < 0x80)
+	{
+	  u[0] = ch;
+	  glyphs[g].len = 1;
+	}
+      else if (ch < 0x800)
+	{
+	  u[0] = 0xc0 | (ch >> 6);
+	  u[1] = 0x80 | (ch & 0x3f);
+	  glyphs[g].len = 2;
+	}
+      else
+	{
+	  u[0] = 0xe0 | (ch >> 12);
+	  u[1] = 0x80 | ((ch >> 6) & 0x3f);
+	  u[2] = 0x80 | (ch & 0x3f);
+	  glyphs[g].len = 3;
+	}
+    }
+}
+
+static enum minsk_status print_line(struct minsk_machine *m, int r)
+{
+  /*
+   *  Meaning of bits of r:
+   *	0 = perform line feed
+   *	1 = clear buffer
+   *	2 = actually print
+   */
+  char buf[128*3 + 3];
+  char *p = buf;
+
+  if (r & 4)
+    {
+      if (m->print_quota > 0 && !--m->print_quota)
+	return stop(m, MINSK_OUT_OF_PAPER);
+      for (int i=0; i<128; i++)
+	{
+	  struct glyph *g = &glyphs[m->linebuf[i]];
+	  memcpy(p, g->utf8, 3);
+	  p += g->len;
+	}
+    }
+  if (r & 2)
+    memset(m->linebuf, 0, sizeof(m->linebuf));
+  if (r & 1)
+    *p++ = '\n';
+  else if (r & 4)
+    *p++ = '\r';
+  fwrite(buf, 1, p - buf, m->out);
+
+  // Flush every flush_lines calls, or leave it to flush_printer() if flush_lines is 0
+  if (++m->unflushed >= m->flush_lines && m->flush_lines > 0)
+    {
+      fflush(m->out);
+      m->unflushed = 0;
+    }
+  return MINSK_RUNNING;
+}
+
+static void flush_printer(struct minsk_machine *m)
+{
+  if (m->unflushed)
+    {
+      fflush(m->out);
+      m->unflushed = 0;
+    }
+}
+
+/*
+ *  Print formats, one per mode: each field of the printed number takes
+ *  the bits selected by shift and mask and looks them up in a table of
+ *  glyphs. In the unsigned mode, leading zeroes are replaced by spaces.
+ */
+
+static const unsigned char sign_glyphs[2] = { G_RUS(012), G_RUS(013) };
+static const unsigned char digit_glyphs[16] = {
+  G_RUS(0), G_RUS(1), G_RUS(2), G_RUS(3), G_RUS(4), G_RUS(5), G_RUS(6), G_RUS(7),
+  G_RUS(010), G_RUS(011), G_LAT(040), G_LAT(041), G_LAT(066), G_LAT(044), G_LAT(045), G_LAT(064)
+};
+static const unsigned char space_glyphs[1] = { G_RUS(017) };
+#define G8(g) (g), (g)+1, (g)+2, (g)+3, (g)+4, (g)+5, (g)+6, (g)+7
+static const unsigned char russian_glyphs[64] = {
+  G8(G_RUS(0)), G8(G_RUS(010)), G8(G_RUS(020)), G8(G_RUS(030)),
+  G8(G_RUS(040)), G8(G_RUS(050)), G8(G_RUS(060)), G8(G_RUS(070))
+};
+static const unsigned char latin_glyphs[64] = {
+  G8(G_LAT(0)), G8(G_LAT(010)), G8(G_LAT(020)), G8(G_LAT(030)),
+  G8(G_LAT(040)), G8(G_LAT(050)), G8(G_LAT(060)), G8(G_LAT(070))
+};
+
+struct print_field {
+  const unsigned char *glyphs;
+  unsigned char shift, mask;
+};
+
+struct print_format {
+  int len;
+  int eat;				// Leading zeroes become spaces
+  struct print_field fields[13];
+};
+
+#define F_SIGN(s) { sign_glyphs, s, 1 }
+#define F_BIT(s) { digit_glyphs, s, 1 }
+#define F_OCT(s) { digit_glyphs, s, 7 }
+#define F_DEC(s) { digit_glyphs, s, 15 }
+#define F_SPACE { space_glyphs, 0, 0 }
+#define F_RUS(s) { russian_glyphs, s, 077 }
+#define F_LAT(s) { latin_glyphs, s, 077 }
+
+static const struct print_format print_formats[8] = {
+  // Decimal float: "+dddddddx+xbd"
+  { 11, 0, { F_SIGN(36), F_DEC(32), F_DEC(28), F_DEC(24), F_DEC(20), F_DEC(16), F_DEC(12), F_DEC(8),
+	     F_SIGN(6), F_BIT(4), F_DEC(0) } },
+  // Octal number: "+oooooooooooo"
+  { 13, 0, { F_SIGN(36), F_OCT(33), F_OCT(30), F_OCT(27), F_OCT(24), F_OCT(21), F_OCT(18),
+	     F_OCT(15), F_OCT(12), F_OCT(9), F_OCT(6), F_OCT(3), F_OCT(0) } },
+  // Decimal fixed: "+ddddddddd"
+  { 10, 0, { F_SIGN(36), F_DEC(32), F_DEC(28), F_DEC(24), F_DEC(20), F_DEC(16), F_DEC(12), F_DEC(8),
+	     F_DEC(4), F_DEC(0) } },
+  // Decimal unsigned: "x ddddddddd"
+  { 10, 1, { F_SPACE, F_DEC(32), F_DEC(28), F_DEC(24), F_DEC(20), F_DEC(16), F_DEC(12), F_DEC(8),
+	     F_DEC(4), F_DEC(0) } },
+  // One Russian symbol: "xr"
+  { 1, 0, { F_RUS(30) } },
+  // Russian text: "xrrrrrr"
+  { 6, 0, { F_RUS(30), F_RUS(24), F_RUS(18), F_RUS(12), F_RUS(6), F_RUS(0) } },
+  // One Latin symbol: "xl"
+  { 1, 0, { F_LAT(30) } },
+  // Latin text: "xllllll"
+  { 6, 0, { F_LAT(30), F_LAT(24), F_LAT(18), F_LAT(12), F_LAT(6), F_LAT(0) } },
+};
+
+static enum minsk_status print_ins(struct minsk_machine *m, int x, loc y)
+{
+  word yy = rd(m, y);
+  int pos = x & 0177;
+  int r = (x >> 9) & 7;
+
+  m->effects++;
+
+  if (x & 0400)
+    return print_line(m, r);
+
+  const struct print_format *fmt = &print_formats[r];
+  int eat = fmt->eat;
+  for (int i=0; i<fmt->len; i++)
+    {
+      const struct print_field *f = &fmt->fields[i];
+      int g = f->glyphs[(yy >> f->shift) & f->mask];
+      if (eat && i < fmt->len - 1)
+	{
+	  if (g == G_RUS(0) || g == G_RUS(017))
+	    g = G_RUS(017);
+	  else
+	    eat = 0;
+	}
+      m->linebuf[pos] = g;
+      pos = (pos+1) & 0177;
+    }
+  return MINSK_RUNNING;
+}
+
+/*
+ *  Superinstructions. Some pairs of instructions follow each other so often
+ *  that the engines charging the CPU quota per block dispatch them as one
+ *  operation: its handler executes the first instruction and when the next
+ *  one has the expected opcode, it jumps straight to its handler instead of
+ *  through the dispatch table. The pairs were picked from the opcode pairs
+ *  executed by the programs in bench/, plus comparisons before a jump.
+ *
+ *  Longer runs are chains of superinstructions, whose handlers jump to the
+ *  handler of the superinstruction at the next cell: 011 005 0120 runs as
+ *  FUSED_ADD_XOR_LOOP, then FUSED_XOR_LOOP, then the loop. A loop whose body
+ *  is such a chain ending with the loop instruction (011 005 or 0110 011 005
+ *  in the bench/ programs) is fused with its body, so the whole loop runs
+ *  without going through the dispatch table.
+ *
+ *  Of the FIX additions, only 011 follows a move in the bench/ programs.
+ *  As each handler jumps to a fixed place, the other variants would need
+ *  superinstructions of their own.
+ *
+ *  Whether the next cell holds the expected instruction is decided when
+ *  the first one is decoded, but the handler checks it again, so a stale
+ *  guess costs only a comparison. All instructions are fetched as usual,
+ *  so the quota, the flight recorder and prev_ip on a trap see each of them.
+ */
+
+enum fused_op {
+  FUSED_ADD_XOR = 0201,			// 011 then 005: summing with a checksum
+  FUSED_ADD_XOR_LOOP,			// 011 then FUSED_XOR_LOOP
+  FUSED_XOR_LOOP,			// 005 then 0120: loop over a table
+  FUSED_SUB_LOOP,			// 021 then 0120: loop updating a counter
+  FUSED_FPSUB_LOOP,			// 054 then 0120: loop over FP values
+  FUSED_MOVE_ADD,			// 0110 then 011: fetch and accumulate
+  FUSED_MOVE_ADD_XOR_LOOP,		// 0110 then FUSED_ADD_XOR_LOOP
+  FUSED_SUB_JPOS,			// 020 then 0132: compare and branch
+  FUSED_SUB_JZERO,			// 020 then 0134: compare and branch
+  FUSED_LOOP_ADD,			// 0120 back to FUSED_ADD_XOR_LOOP ending with it
+  FUSED_LOOP_MOVE,			// 0120 back to FUSED_MOVE_ADD_XOR_LOOP ending with it
+  FUSED_MAX,
+};
+
+// Called for every decoded instruction, so self-modifying code makes it hot
+static int fuse(struct minsk_machine *m, int addr, int op)
+{
+  int next = (m->mem[(addr+1) & 07777] >> 30) & 0177;
+  int target, body;
+  switch (op)
+    {
+    case 005:
+      return (next == 0120) ? FUSED_XOR_LOOP : op;
+    case 011:
+      if (next != 005)
+	return op;
+      return (fuse(m, (addr+1) & 07777, next) == FUSED_XOR_LOOP) ? FUSED_ADD_XOR_LOOP : FUSED_ADD_XOR;
+    case 020:
+      return (next == 0132) ? FUSED_SUB_JPOS : (next == 0134) ? FUSED_SUB_JZERO : op;
+    case 021:
+      return (next == 0120) ? FUSED_SUB_LOOP : op;
+    case 054:
+      return (next == 0120) ? FUSED_FPSUB_LOOP : op;
+    case 0110:
+      if (next != 011)
+	return op;
+      return (fuse(m, (addr+1) & 07777, next) == FUSED_ADD_XOR_LOOP) ? FUSED_MOVE_ADD_XOR_LOOP : FUSED_MOVE_ADD;
+    case 0120:
+      target = (m->mem[addr] >> 12) & 07777;
+      body = (addr - target) & 07777;
+      if (body != 2 && body != 3)
+	return op;
+      next = fuse(m, target, (m->mem[target] >> 30) & 0177);
+      if (body == 2 && next == FUSED_ADD_XOR_LOOP)
+	return FUSED_LOOP_ADD;
+      if (body == 3 && next == FUSED_MOVE_ADD_XOR_LOOP)
+	return FUSED_LOOP_MOVE;
+      return op;
+    default:
+      return op;
+    }
+}
+
+/*
+ *  Loop idioms. A loop instruction jumping back to a single instruction
+ *  right before it, which moves, negates or combines table cells indexed
+ *  by the loop's own index cell, copies, clears or scales whole tables.
+ *  The engines charging the CPU quota per block run the remaining
+ *  iterations of such loops at once, with the same effect on memory,
+ *  registers, the quota and the flight recorder as running them
+ *  instruction by instruction. Whether a loop has this shape is decided
+ *  when it is decoded, but bulk_loop() checks it again.
+ */
+
+static int idiom_body(int op)
+{
+  switch (op)
+    {
+    case 005:				// XOR
+    case 031:				// FIX multiplication
+    case 071:				// And
+    case 075:				// Or
+    case 0110 ... 0112:			// Moves
+      return 1;
+    default:
+      return 0;
+    }
+}
+
+static int loop_idiom(struct minsk_machine *m, int addr, decoded *d)
+{
+  int body = (addr-1) & 07777;
+  word w = m->mem[body];
+  return d->op == 0120 && d->ix && d->x.address == body &&
+    !d->x.block && !d->y.block &&
+    idiom_body((w >> 30) & 0177) &&
+    (int) ((w >> 24) & 077) == d->ix &&	// Same index cell, no address extensions
+    d->ix != body && d->ix != addr && d->ix != d->y.address;
+}
+
+/*
+ *  The loop runs as a block move or fill if it only copies cells (possibly
+ *  changing their signs) from consecutive or equal source addresses to
+ *  consecutive destination addresses which are neither decoded instructions
+ *  nor cells the loop depends on, and if copying one cell at a time would
+ *  not make later iterations read what earlier ones wrote. All count
+ *  iterations must qualify, but only the first n are done. Returns 1 if
+ *  they were, with the value read by the last one in *v.
+ */
+static int bulk_copy(struct minsk_machine *m, decoded *body, int count, int n, int avoid[2], word iw, word inc, word *v)
+{
+  int op = body->op, dx = (inc >> 12) & 07777, dy = inc & 07777;
+  int x = (body->x.address + (int)((iw >> 12) & 07777)) & 07777;
+  int y = (body->y.address + (int)(iw & 07777)) & 07777;
+  if (n <= 0 || op < 0110 || dy != 1 || dx > 1 || y + count > MEM_SIZE)
+    return 0;
+  for (int i=0; i<2; i++)
+    if (avoid[i] >= y && avoid[i] < y + count)
+      return 0;
+  if (dx)
+    {
+      // The index cell changes as we go, so it must not be read
+      if (!x || x + count > MEM_SIZE || (x < y && y < x + count) || (avoid[0] >= x && avoid[0] < x + count))
+	return 0;
+    }
+  else if (x >= y && x < y + count || x == avoid[0])
+    return 0;
+  for (int i=0; i<count; i++)
+    if (m->icache[y+i].valid)
+      return 0;
+
+  word *src = &m->mem[x], *dst = &m->mem[y];
+  word mask = (op == 0112) ? VAL_MASK : WORD_MASK;
+  word flip = (op == 0111) ? SIGN_MASK : 0;
+  if (!dx)
+    {
+      word val = x ? ((*src & mask) ^ flip) : flip & mask;
+      for (int i=0; i<n; i++)
+	dst[i] = val;
+      *v = x ? *src : 0;
+    }
+  else
+    {
+      *v = src[n-1];
+      if (op == 0110)
+	memmove(dst, src, n * sizeof(word));
+      else
+	for (int i=0; i<n; i++)		// Safe, the destination does not run ahead of the source
+	  dst[i] = (src[i] & mask) ^ flip;
+    }
+  return 1;
+}
+
+/*
+ *  Called by the engine after the loop instruction jumped back to the body.
+ *  Runs the following iterations, as long as the loop does not change
+ *  itself and jumps back again, so that the engine finishes just the last
+ *  one (and any iterations beyond the CPU quota).
+ */
+static void bulk_loop(struct minsk_machine *m, decoded *loop)
+{
+  int body_ip = m->ip, loop_ip = m->prev_ip;
+  decoded *body = &m->icache[body_ip];
+  if (!body->valid || !idiom_body(body->op) || body->ix != loop->ix || body->x.block || body->y.block)
+    return;
+
+  loc iaddr = { 0, loop->ix };
+  word iw = mem_rd(m, iaddr, 0, 0);
+  word inc = mem_rd(m, loop->y, 0, 0);
+  int count = (iw >> 24) & 017777;
+  if (m->cpu_quota > 0 && count > (m->cpu_quota - 1) / 2)
+    count = (m->cpu_quota - 1) / 2;	// The engine would stop in the middle, let it do so
+  for (int i=0, y=iw & 07777; i<count; i++, y=(y + inc) & 07777)
+    {
+      int a = (body->y.address + y) & 07777;
+      if (a == iaddr.address || a == loop->y.address || a == body_ip || a == loop_ip)
+	{
+	  count = i;			// The loop would change itself here, leave it to the engine
+	  break;
+	}
+    }
+  int tail = m->rec ? (m->rec_mask + 2) / 2 : 0;	// Iterations which the flight recorder keeps
+  int avoid[2] = { iaddr.address, loop->y.address };
+  word acc = m->acc, r1 = m->r1, r2 = m->r2, v;
+  int done = 0;
+
+  int n = count - tail;
+  if (bulk_copy(m, body, count, n, avoid, iw, inc, &v))
+    {
+      int cnt = ((iw >> 24) & 017777) - n + 1;
+      int x = (int)((iw >> 12) + (n-1) * ((inc >> 12) & 07777)) & 07777;
+      int y = (int)(iw + (n-1) * (inc & 07777)) & 07777;
+      r1 = ((word) cnt << 24) | (word) x << 12 | y;
+      switch (body->op)
+	{
+	case 0110:
+	  r2 = v;
+	  break;
+	case 0111:
+	  r2 = v ^ SIGN_MASK;
+	  break;
+	default:
+	  r2 = v & VAL_MASK;
+	}
+      iw = acc = ((word) (cnt-1) << 24) |
+	(word) ((x + (inc >> 12)) & 07777) << 12 |
+	((y + inc) & 07777);
+      mem_wr(m, iaddr, iw, 0, 0);	// The count changes, so loop_check() sees the copy as an effect
+      done = n;
+    }
+
+  // Other bodies and the recorded iterations: one by one, through mem_rd() and mem_wr()
+  for (; done < count; done++)
+    {
+      loc xi = { 0, (body->x.address + (int)((iw >> 12) & 07777)) & 07777 };
+      loc yi = { 0, (body->y.address + (int)(iw & 07777)) & 07777 };
+      int rec = count - done <= tail;
+      if (rec)
+	{
+	  m->acc = acc;
+	  m->r1 = r1;
+	  record_ins(m, body_ip, xi, yi);
+	}
+      r2 = acc;
+      v = r1 = mem_rd(m, xi, 0, 0);
+      switch (body->op)
+	{
+	case 005:
+	  acc = mem_rd(m, yi, 0, 0) ^ v;
+	  break;
+	case 031:
+	  acc = fix_mul(mem_rd(m, yi, 0, 0), v);
+	  break;
+	case 071:
+	  acc = mem_rd(m, yi, 0, 0) & v;
+	  break;
+	case 075:
+	  acc = mem_rd(m, yi, 0, 0) | v;
+	  break;
+	case 0110:
+	  acc = v;
+	  break;
+	case 0111:
+	  acc = v ^ SIGN_MASK;
+	  break;
+	default:
+	  acc = v & VAL_MASK;
+	}
+      mem_wr(m, yi, acc, 0, 0);
+
+      // The loop instruction, which jumps back
+      if (rec)
+	{
+	  m->acc = acc;
+	  m->r1 = r1;
+	  record_ins(m, loop_ip, loop->x, loop->y);
+	}
+      r2 = acc;
+      r1 = iw;
+      iw = acc = ((((iw >> 24) & 017777) - 1) << 24) |
+	((((iw >> 12) + (inc >> 12)) & 07777) << 12) |
+	((iw + inc) & 07777);
+      mem_wr(m, iaddr, iw, 0, 0);
+    }
+
+  if (!done)
+    return;
+  m->acc = acc;
+  m->r1 = r1;
+  m->r2 = r2;
+  if (m->cpu_quota > 0)
+    m->cpu_quota -= 2*done;
+}
+
+static void decode(struct minsk_machine *m, int addr)
+{
+  word w = m->mem[addr];
+  decoded *d = &m->icache[addr];
+
+  d->op = (w >> 30) & 0177;		// Operation code
+  int ax = (w >> 28) & 3;		// Address extensions supported in Minsk-22 mode
+  d->ix = (w >> 24) & 15;		// Indexing
+  d->x = (loc) { ax >> 1, (w >> 12) & 07777 };	// Operands (original form)
+  d->y = (loc) { ax & 1, w & 07777 };
+  d->indexed = d->ix && d->op != 0120;
+  if (ax && m->memblocks == 1)	// Reject address extensions if we only have 1 memory block
+    d->op = 0200;
+
+  switch (d->op)
+    {
+    case 000:
+    case 004 ... 077:
+    case 0110 ... 0112:
+    case 0114:
+    case 0116:
+    case 0170 ... 0176:
+      d->ends_block = 0;
+      break;
+    default:			// Jumps, printing and everything that stops the machine
+      d->ends_block = 1;
+    }
+  d->fop = fuse(m, addr, d->op);
+  d->idiom = loop_idiom(m, addr, d);
+  d->block_gen = m->code_gen - 1;	// Length of the block starting here not known yet
+  d->valid = 1;
+  if (m->aot)
+    m->aot->watch[addr] = 1;
+}
+
+/*
+ *  Without tracing, the CPU quota is charged once per basic block, that is
+ *  a run of instructions ending with a jump, printing or a stop. The length
+ *  of the block starting at a given address is cached in its decoded record
+ *  until any instruction changes. When a block reaches beyond the quota,
+ *  run() finishes the job with an engine counting every instruction.
+ */
+
+static int block_length(struct minsk_machine *m, int addr)
+{
+  decoded *d = &m->icache[addr];
+  if (d->valid && d->block_gen == m->code_gen)
+    return d->block_len;
+
+  int len = 0;
+  int a = addr;
+  for (;;)
+    {
+      decoded *e = &m->icache[a];
+      if (!e->valid)
+	decode(m, a);
+      len++;
+      if (e->ends_block)
+	break;
+      if (len >= MEM_SIZE)	// Straight line all around the memory
+	return 0;
+      a = (a+1) & 07777;
+    }
+
+  d->block_len = len;
+  d->block_gen = m->code_gen;
+  return len;
+}
+
+static int charge_block(struct minsk_machine *m)
+{
+  int len = block_length(m, m->ip);
+  if (!len || m->cpu_quota <= len)
+    return 0;
+  m->cpu_quota -= len;
+  m->block_end = (m->ip + len - 1) & 07777;
+  return 1;
+}
+
+// A trap in the middle of a block gives back the quota charged for the rest of it
+static enum minsk_status refund_block(struct minsk_machine *m)
+{
+  enum minsk_status st = m->status;
+  if (m->cpu_quota > 0 && (st == MINSK_OVERFLOW || st == MINSK_ILLEGAL || st == MINSK_NOT_IMPLEMENTED))
+    m->cpu_quota += (m->block_end - m->prev_ip) & 07777;
+  return st;
+}
+
+/*
+ *  Infinite loops. If the whole state of the machine (memory, registers
+ *  and the next instruction) at a block entry equals its state at an
+ *  earlier block entry and nothing was printed in between, the program
+ *  cycles for ever. Instead of comparing the memory, we count the writes
+ *  which changed a cell and the print instructions: if the count did not
+ *  move, the memory is the same. The current state is compared with an
+ *  anchor taken at block entries spaced by powers of two up to LOOP_WINDOW
+ *  (Brent's cycle detection), so every cycle of up to LOOP_WINDOW blocks,
+ *  down to a jump to itself, is found within a few rounds. Cycles which
+ *  change the memory and restore it later are left to the quota. Block
+ *  entries after a block which changed a cell cannot repeat a state, so
+ *  only the others count. Native code goes from block to block on its own
+ *  while it changes something, but returns to the interpreter for the
+ *  check as soon as it does not.
+ */
+
+#define LOOP_WINDOW 1024		// Longest cycle found, in block entries
+
+static ALWAYS_INLINE int loop_check(struct minsk_machine *m)
+{
+  struct loop_anchor *l = &m->loop;
+  if (m->effects != l->quiet)
+    {
+      // The block before changed a cell, so no earlier state can be the same
+      l->quiet = m->effects;
+      return 0;
+    }
+  if (m->ip == l->ip && m->effects == l->effects && m->acc == l->acc && m->r1 == l->r1 && m->r2 == l->r2)
+    {
+      stop(m, MINSK_INFINITE_LOOP);
+      return 1;
+    }
+  if (++l->steps >= l->window)
+    {
+      l->ip = m->ip;
+      l->acc = m->acc;
+      l->r1 = m->r1;
+      l->r2 = m->r2;
+      l->effects = m->effects;
+      l->steps = 0;
+      if (l->window < LOOP_WINDOW)
+	l->window *= 2;
+    }
+  return 0;
+}
+
+static void loop_reset(struct minsk_machine *m)
+{
+  memset(&m->loop, 0, sizeof(m->loop));
+  m->loop.ip = -1;
+  m->loop.window = 1;
+}
+
+/*
+ *  Native code, translated by the JIT or ahead of time, leaves a mark
+ *  in the flight recorder when it starts running at ip ...
+ */
+
+static void native_mark(struct minsk_machine *m)
+{
+  if (m->rec)
+    {
+      // Repeated runs of the same block get a single mark
+      record *r = &m->rec[(m->rec_pos - 1) & m->rec_mask];
+      if (!m->rec_pos || !r->jit || r->ip != m->ip)
+	{
+	  r = &m->rec[m->rec_pos++ & m->rec_mask];
+	  memset(r, 0, sizeof(*r));
+	  r->ip = m->ip;
+	  r->jit = 1;
+	}
+    }
+}
+
+// ... and if it overflows, we stop as the interpreter would
+static void native_overflow(struct minsk_machine *m, int ip)
+{
+  m->prev_ip = ip;
+  m->ip = (ip+1) & 07777;
+  if (m->rec)
+    {
+      // Record the overflowing instruction, indexed like fetch() does
+      decoded *e = &m->icache[ip];
+      if (!e->valid)
+	decode(m, ip);
+      loc x = e->x, y = e->y;
+      if (e->indexed)
+	{
+	  word i = m->mem[e->ix];
+	  x.address = (x.address + (int)((i >> 12) & 07777)) & 07777;
+	  y.address = (y.address + (int)(i & 07777)) & 07777;
+	}
+      record_ins(m, ip, x, y);
+    }
+  over(m);
+}
+
+/*** JIT compiler ***/
+
+#ifdef ENABLE_JIT
+
+/*
+ *  Hot basic blocks are translated to x86-64 machine code. The engine counts
+ *  entries to jump targets in their decoded records; once a target gets hot,
+ *  its block is translated up to the jump ending it, or up to the first
+ *  instruction the translator does not handle, where the code returns to
+ *  the interpreter. Before a store to a cell holding a decoded instruction,
+ *  the code returns to the interpreter as well, so that wr() sees all
+ *  writes to code. Any change of code makes the translations stale, just
+ *  like the cached block lengths. A block jumping back to its own start
+ *  loops natively as long as the CPU quota allows.
+ *
+ *  Register usage of the generated code:
+ *
+ *	rbx	accumulator (R2 always equals it at instruction boundaries)
+ *	r12	R1
+ *	r13	VAL_MASK
+ *	r14	memory block 0
+ *	r15	struct jit_state
+ *	rbp	icache
+ *	r11	zero
+ */
+
+#include <stddef.h>
+
+#define JIT_THRESHOLD 64		// Entries before a block is translated
+#define JIT_MAX_INS 64			// Longest translated block
+#define JIT_BUF_SIZE (1 << 20)
+#define JIT_MAX_CODE (JIT_MAX_INS * 256)	// Upper bound on code for one block
+#define JIT_MAX_STUBS (6 * JIT_MAX_INS + 4)
+
+struct jit_state {
+  word acc, r1;
+  word r2;				// Accumulator before the last jump...
+  long long quota;
+  unsigned long long effects;
+  unsigned long long quiet;		// Effects at the last block entry (see loop_check())...
+  unsigned long long nocheck;		// ... XOR this (all ones if not checking, so they never match)
+  word *mem;
+  decoded *icache;
+  int ip;
+  int prev_ip;				// ... and its address (or of the overflowing instruction)
+};
+
+enum jit_status {
+  JIT_JUMP,				// Jumped to a new block at ip
+  JIT_INTERP,				// The interpreter should continue at ip
+  JIT_OVERFLOW,				// Overflow at prev_ip
+};
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { CC_C = 2, CC_NC = 3, CC_Z = 4, CC_NZ = 5, CC_A = 7, CC_S = 8, CC_LE = 14 };
+
+struct jit_stub {
+  unsigned char *patch;			// rel32 to point to the stub
+  int status;
+  int addr;
+};
+
+// Per-machine translator state
+struct jit {
+  unsigned char *buf, *ptr;		// Code buffer and where the next block goes
+  int broken;				// Failed to set up executable memory
+  unsigned char *start;			// Code of the block being translated...
+  int block_start, block_len;		// ... and its address and length
+  struct jit_stub stubs[JIT_MAX_STUBS];
+  int nstubs;
+};
+
+static void jit_byte(struct jit *j, int b)
+{
+  *j->ptr++ = b;
+}
+
+static void jit_long(struct jit *j, uint32_t x)
+{
+  memcpy(j->ptr, &x, 4);
+  j->ptr += 4;
+}
+
+static void jit_quad(struct jit *j, uint64_t x)
+{
+  memcpy(j->ptr, &x, 8);
+  j->ptr += 8;
+}
+
+static void jit_opcode(struct jit *j, int w, int op, int reg, int index, int base)
+{
+  int rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+  if (rex != 0x40)
+    jit_byte(j, rex);
+  if (op > 0xff)
+    jit_byte(j, op >> 8);
+  jit_byte(j, op & 0xff);
+}
+
+// Register-register instruction (reg is the ModRM reg field, or the opcode extension)
+static void jit_rr(struct jit *j, int w, int op, int reg, int rm)
+{
+  jit_opcode(j, w, op, reg, 0, rm);
+  jit_byte(j, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// Register-memory instruction addressing [base + index*scale + disp32] (index < 0 if none)
+static void jit_rm(struct jit *j, int w, int op, int reg, int base, int index, int scale, int disp)
+{
+  jit_opcode(j, w, op, reg, (index < 0 ? 0 : index), base);
+  if (index < 0 && (base & 7) != RSP)
+    jit_byte(j, 0x80 | ((reg & 7) << 3) | (base & 7));
+  else
+    {
+      jit_byte(j, 0x84 | ((reg & 7) << 3));
+      jit_byte(j, ((scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0) << 6) |
+	       ((index < 0 ? RSP : index) & 7) << 3 | (base & 7));
+    }
+  jit_long(j, disp);
+}
+
+#define JIT_MOV_LOAD	0x8b
+#define JIT_MOV_STORE	0x89
+#define JIT_ADD		0x01
+#define JIT_SUB		0x29
+#define JIT_AND		0x21
+#define JIT_OR		0x09
+#define JIT_XOR		0x31
+#define JIT_TEST	0x85
+#define JIT_CMP		0x39
+#define JIT_CMOV(cc)	(0x0f40 + (cc))
+
+static void jit_alu_imm(struct jit *j, int ext, int reg, int32_t imm)	// add=0, or=1, and=4, sub=5, cmp=7
+{
+  jit_rr(j, 1, 0x81, ext, reg);
+  jit_long(j, imm);
+}
+
+static void jit_shift(struct jit *j, int ext, int reg, int count)	// shl=4, shr=5
+{
+  jit_rr(j, 1, 0xc1, ext, reg);
+  jit_byte(j, count);
+}
+
+static void jit_bit(struct jit *j, int ext, int reg, int bit)		// bt=4, bts=5, btc=7
+{
+  jit_rr(j, 1, 0x0fba, ext, reg);
+  jit_byte(j, bit);
+}
+
+static void jit_mov_imm(struct jit *j, int reg, uint64_t imm)
+{
+  jit_opcode(j, 1, 0xb8 + (reg & 7), 0, 0, reg);
+  jit_quad(j, imm);
+}
+
+static void jit_push_pop(struct jit *j, int op, int reg)
+{
+  if (reg & 8)
+    jit_byte(j, 0x41);
+  jit_byte(j, op + (reg & 7));
+}
+
+static unsigned char *jit_jump_rel32(struct jit *j, int cc)		// cc < 0 for an unconditional jump
+{
+  if (cc < 0)
+    jit_byte(j, 0xe9);
+  else
+    {
+      jit_byte(j, 0x0f);
+      jit_byte(j, 0x80 + cc);
+    }
+  jit_long(j, 0);
+  return j->ptr - 4;
+}
+
+static void jit_patch(unsigned char *patch, unsigned char *target)
+{
+  int32_t rel = target - (patch + 4);
+  memcpy(patch, &rel, 4);
+}
+
+static void jit_stub(struct jit *j, int cc, int status, int addr)
+{
+  struct jit_stub *s = &j->stubs[j->nstubs++];
+  s->patch = jit_jump_rel32(j, cc);
+  s->status = status;
+  s->addr = addr;
+}
+
+// Operands are either static addresses, or computed by indexing into a register
+typedef struct jit_loc {
+  int reg;				// -1 if static
+  int addr;
+} jit_loc;
+
+static void jit_load(struct jit *j, int dst, jit_loc a)
+{
+  if (a.reg < 0)
+    {
+      if (a.addr)
+	jit_rm(j, 1, JIT_MOV_LOAD, dst, R14, -1, 0, a.addr * 8);
+      else
+	jit_rr(j, 0, JIT_XOR, dst, dst);
+    }
+  else
+    {
+      jit_rm(j, 1, JIT_MOV_LOAD, dst, R14, a.reg, 8, 0);
+      jit_rr(j, 1, JIT_TEST, a.reg, a.reg);
+      jit_rr(j, 1, JIT_CMOV(CC_Z), dst, R11);	// Cell 0 always reads as zero
+    }
+}
+
+static void jit_store(struct jit *j, jit_loc a, int src, int p)
+{
+  // Leave to the interpreter if the cell holds a decoded instruction
+  int valid = offsetof(decoded, valid);
+  if (a.reg < 0)
+    jit_rm(j, 0, 0x83, 7, RBP, -1, 0, a.addr * sizeof(decoded) + valid);
+  else
+    {
+      jit_rr(j, 1, 0x69, R10, a.reg);
+      jit_long(j, sizeof(decoded));
+      jit_rm(j, 0, 0x83, 7, RBP, R10, 1, valid);
+    }
+  jit_byte(j, 0);
+  jit_stub(j, CC_NZ, JIT_INTERP, p);
+
+  // Count the write if it changes the cell (see loop_check())
+  if (a.reg < 0)
+    jit_rm(j, 1, JIT_CMP, src, R14, -1, 0, a.addr * 8);
+  else
+    jit_rm(j, 1, JIT_CMP, src, R14, a.reg, 8, 0);
+  unsigned char *same = jit_jump_rel32(j, CC_Z);
+  jit_rm(j, 1, 0xff, 0, R15, -1, 0, offsetof(struct jit_state, effects));	// inc
+  jit_patch(same, j->ptr);
+
+  if (a.reg < 0)
+    jit_rm(j, 1, JIT_MOV_STORE, src, R14, -1, 0, a.addr * 8);
+  else
+    jit_rm(j, 1, JIT_MOV_STORE, src, R14, a.reg, 8, 0);
+}
+
+// Sign-magnitude to two's complement, using tmp
+static void jit_to_signed(struct jit *j, int reg, int tmp)
+{
+  jit_rr(j, 1, JIT_MOV_STORE, reg, RDX);
+  jit_rr(j, 1, JIT_AND, R13, reg);
+  jit_rr(j, 1, JIT_MOV_STORE, reg, tmp);
+  jit_rr(j, 1, 0xf7, 3, tmp);			// neg
+  jit_bit(j, 4, RDX, 36);
+  jit_rr(j, 1, JIT_CMOV(CC_C), reg, tmp);
+}
+
+// Two's complement in rax to sign-magnitude in rdx, trapping on overflow
+static void jit_from_signed(struct jit *j, int p)
+{
+  jit_rr(j, 1, JIT_MOV_STORE, RAX, RDX);
+  jit_rr(j, 1, 0xf7, 3, RDX);			// neg
+  jit_rr(j, 1, JIT_CMOV(CC_S), RDX, RAX);		// rdx = |rax|
+  jit_rr(j, 1, 0x39, R13, RDX);			// cmp rdx, r13
+  jit_stub(j, CC_A, JIT_OVERFLOW, p);
+  jit_rr(j, 1, JIT_MOV_STORE, RDX, R8);
+  jit_bit(j, 5, R8, 36);
+  jit_rr(j, 1, JIT_TEST, RAX, RAX);
+  jit_rr(j, 1, JIT_CMOV(CC_S), RDX, R8);
+}
+
+static void jit_goto(struct jit *j, int cc, int target)
+{
+  if (target != j->block_start || !j->block_len)
+    {
+      jit_stub(j, cc, JIT_JUMP, target);
+      return;
+    }
+
+  // Jump back to the start of the block, charging the CPU quota, unless the interpreter should check for an infinite loop
+  unsigned char *skip = NULL;
+  if (cc >= 0)
+    skip = jit_jump_rel32(j, cc ^ 1);
+  int effects = offsetof(struct jit_state, effects), quiet = offsetof(struct jit_state, quiet);
+  jit_rm(j, 1, JIT_MOV_LOAD, RAX, R15, -1, 0, effects);
+  jit_rm(j, 1, JIT_CMP, RAX, R15, -1, 0, quiet);
+  jit_stub(j, CC_Z, JIT_JUMP, target);
+  int quota = offsetof(struct jit_state, quota);
+  jit_rm(j, 1, JIT_MOV_LOAD, RAX, R15, -1, 0, quota);
+  jit_rr(j, 1, JIT_TEST, RAX, RAX);
+  unsigned char *unlimited = jit_jump_rel32(j, CC_LE);
+  jit_alu_imm(j, 7, RAX, j->block_len);
+  jit_stub(j, CC_LE, JIT_JUMP, target);
+  jit_alu_imm(j, 5, RAX, j->block_len);
+  jit_rm(j, 1, JIT_MOV_STORE, RAX, R15, -1, 0, quota);
+  jit_patch(unlimited, j->ptr);
+  jit_rm(j, 1, JIT_MOV_LOAD, RAX, R15, -1, 0, effects);
+  jit_rm(j, 1, JIT_MOV_LOAD, RCX, R15, -1, 0, offsetof(struct jit_state, nocheck));
+  jit_rr(j, 1, JIT_XOR, RAX, RCX);
+  jit_rm(j, 1, JIT_MOV_STORE, RCX, R15, -1, 0, quiet);
+  jit_patch(jit_jump_rel32(j, -1), j->start);
+  if (skip)
+    jit_patch(skip, j->ptr);
+}
+
+static int jit_supported(decoded *e)
+{
+  if (e->x.block || e->y.block)
+    return 0;
+  switch (e->op)
+    {
+    case 000:
+    case 004 ... 013:
+    case 020 ... 023:
+    case 050 ... 053:
+    case 070 ... 077:
+    case 0110 ... 0112:
+    case 0130 ... 0135:
+      return 1;
+    case 0120:
+      return e->ix != 0 && !e->idiom;	// Idioms run faster as a whole (see bulk_loop())
+    default:
+      return 0;
+    }
+}
+
+static void jit_ins(struct jit *j, int p, decoded *e)
+{
+  int op = e->op;
+  jit_loc x = { -1, e->x.address }, y = { -1, e->y.address };
+
+  if (e->indexed && op < 0120)		// Jumps use the original operands
+    {
+      jit_rm(j, 1, JIT_MOV_LOAD, RAX, R14, -1, 0, e->ix * 8);
+      jit_rr(j, 1, JIT_MOV_STORE, RAX, RSI);
+      jit_shift(j, 5, RSI, 12);
+      jit_alu_imm(j, 0, RSI, x.addr);
+      jit_alu_imm(j, 4, RSI, 07777);
+      jit_rr(j, 1, JIT_MOV_STORE, RAX, RDI);
+      jit_alu_imm(j, 0, RDI, y.addr);
+      jit_alu_imm(j, 4, RDI, 07777);
+      x.reg = RSI;
+      y.reg = RDI;
+    }
+  if (op >= 0120)
+    {
+      // After a jump, R2 holds the accumulator from before it
+      jit_rm(j, 1, JIT_MOV_STORE, RBX, R15, -1, 0, offsetof(struct jit_state, r2));
+      jit_rm(j, 0, 0xc7, 0, R15, -1, 0, offsetof(struct jit_state, prev_ip));
+      jit_long(j, p);
+    }
+
+  switch (op)
+    {
+    case 000:
+      break;
+    case 004 ... 013:
+    case 020 ... 023:
+    case 050 ... 053:
+    case 070 ... 077:
+      if (op & 2)
+	jit_rr(j, 1, JIT_MOV_STORE, RBX, RAX);
+      else
+	jit_load(j, RAX, y);
+      jit_load(j, RCX, x);
+      jit_rr(j, 1, JIT_MOV_STORE, RCX, R12);
+      switch (op & ~3)
+	{
+	case 004:
+	  jit_rr(j, 1, JIT_XOR, RCX, RAX);
+	  break;
+	case 070:
+	  jit_rr(j, 1, JIT_AND, RCX, RAX);
+	  break;
+	case 074:
+	  jit_rr(j, 1, JIT_OR, RCX, RAX);
+	  break;
+	case 050:
+	  jit_rr(j, 1, JIT_AND, R13, RAX);
+	  jit_rr(j, 1, JIT_AND, R13, RCX);
+	  jit_rr(j, 1, JIT_SUB, RCX, RAX);
+	  break;
+	default:
+	  jit_to_signed(j, RAX, R8);
+	  jit_to_signed(j, RCX, R8);
+	  jit_rr(j, 1, (op & ~3) == 010 ? JIT_ADD : JIT_SUB, RCX, RAX);
+	}
+      if ((op & ~3) == 010 || (op & ~3) == 020 || (op & ~3) == 050)
+	jit_from_signed(j, p);
+      else
+	jit_rr(j, 1, JIT_MOV_STORE, RAX, RDX);
+      if (op & 1)
+	jit_store(j, y, RDX, p);
+      jit_rr(j, 1, JIT_MOV_STORE, RDX, RBX);
+      break;
+    case 0110 ... 0112:
+      jit_load(j, RCX, x);
+      jit_rr(j, 1, JIT_MOV_STORE, RCX, RDX);
+      if (op == 0111)
+	jit_bit(j, 7, RDX, 36);
+      else if (op == 0112)
+	jit_rr(j, 1, JIT_AND, R13, RDX);
+      jit_store(j, y, RDX, p);
+      jit_rr(j, 1, JIT_MOV_STORE, RCX, R12);
+      jit_rr(j, 1, JIT_MOV_STORE, RDX, RBX);
+      break;
+    case 0120:
+      jit_rm(j, 1, JIT_MOV_LOAD, RAX, R14, -1, 0, e->ix * 8);
+      jit_rr(j, 1, JIT_MOV_STORE, RAX, R12);
+      jit_rr(j, 1, JIT_MOV_STORE, RAX, RDX);
+      jit_shift(j, 5, RDX, 24);
+      jit_alu_imm(j, 4, RDX, 017777);
+      jit_goto(j, CC_Z, (p+1) & 07777);
+      jit_load(j, RCX, y);
+      jit_rr(j, 1, JIT_MOV_STORE, RAX, RSI);	// Sum of the first addresses
+      jit_shift(j, 5, RSI, 12);
+      jit_rr(j, 1, JIT_MOV_STORE, RCX, R8);
+      jit_shift(j, 5, R8, 12);
+      jit_rr(j, 1, JIT_ADD, R8, RSI);
+      jit_alu_imm(j, 4, RSI, 07777);
+      jit_shift(j, 4, RSI, 12);
+      jit_rr(j, 1, JIT_MOV_STORE, RAX, RDI);	// Sum of the second addresses
+      jit_rr(j, 1, JIT_ADD, RCX, RDI);
+      jit_alu_imm(j, 4, RDI, 07777);
+      jit_rr(j, 1, JIT_OR, RDI, RSI);
+      jit_alu_imm(j, 5, RDX, 1);			// Decremented counter
+      jit_shift(j, 4, RDX, 24);
+      jit_rr(j, 1, JIT_OR, RSI, RDX);
+      jit_store(j, (jit_loc) { -1, e->ix }, RDX, p);
+      jit_rr(j, 1, JIT_MOV_STORE, RDX, RBX);
+      jit_goto(j, -1, x.addr);
+      break;
+    case 0130:
+      jit_store(j, y, RBX, p);
+      jit_goto(j, -1, x.addr);
+      break;
+    case 0131:
+      jit_mov_imm(j, RDX, (0130ULL << 30) | (((p+1) & 07777ULL) << 12));
+      jit_store(j, y, RDX, p);
+      jit_rr(j, 1, JIT_MOV_STORE, RDX, RBX);
+      jit_goto(j, -1, x.addr);
+      break;
+    case 0132:
+      jit_bit(j, 4, RBX, 36);
+      jit_goto(j, CC_C, y.addr);
+      jit_goto(j, -1, x.addr);
+      break;
+    case 0133:
+      jit_goto(j, -1, x.addr);
+      break;
+    case 0134:
+      jit_rr(j, 1, JIT_TEST, R13, RBX);
+      jit_goto(j, CC_Z, y.addr);
+      jit_goto(j, -1, x.addr);
+      break;
+    case 0135:
+      jit_goto(j, -1, y.addr);
+      break;
+    default:
+      assert(0);
+    }
+}
+
+static struct jit *jit_new(void)
+{
+  struct jit *j = calloc(1, sizeof(struct jit));
+  if (!j)
+    return NULL;
+  j->buf = mmap(NULL, JIT_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (j->buf == MAP_FAILED)
+    {
+      j->buf = NULL;
+      j->broken = 1;
+    }
+  j->ptr = j->buf;
+  return j;
+}
+
+static void jit_free(struct minsk_machine *m)
+{
+  struct jit *j = m->jit;
+  if (!j)
+    return;
+  if (j->buf)
+    munmap(j->buf, JIT_BUF_SIZE);
+  free(j);
+  m->jit = NULL;
+}
+
+static jit_code jit_translate(struct minsk_machine *m, int start)
+{
+  if (!m->jit && !(m->jit = jit_new()))
+    return NULL;
+  struct jit *j = m->jit;
+  if (j->broken)
+    return NULL;
+
+  int len = block_length(m, start);
+  if (!jit_supported(&m->icache[start]))
+    return NULL;
+
+  if (mprotect(j->buf, JIT_BUF_SIZE, PROT_READ | PROT_WRITE) < 0)
+    {
+      j->broken = 1;
+      return NULL;
+    }
+  if (j->ptr + JIT_MAX_CODE > j->buf + JIT_BUF_SIZE)
+    {
+      // Out of space: throw away all translations
+      j->ptr = j->buf;
+      m->code_gen++;
+    }
+
+  unsigned char *code = j->ptr;
+  int st_acc = offsetof(struct jit_state, acc);
+  int st_r1 = offsetof(struct jit_state, r1);
+  static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+
+  for (int i=0; i<6; i++)
+    jit_push_pop(j, 0x50, saved[i]);
+  jit_rr(j, 1, JIT_MOV_STORE, RDI, R15);
+  jit_rm(j, 1, JIT_MOV_LOAD, RBX, R15, -1, 0, st_acc);
+  jit_rm(j, 1, JIT_MOV_LOAD, R12, R15, -1, 0, st_r1);
+  jit_rm(j, 1, JIT_MOV_LOAD, R14, R15, -1, 0, offsetof(struct jit_state, mem));
+  jit_rm(j, 1, JIT_MOV_LOAD, RBP, R15, -1, 0, offsetof(struct jit_state, icache));
+  jit_mov_imm(j, R13, VAL_MASK);
+  jit_rr(j, 0, JIT_XOR, R11, R11);
+
+  j->start = j->ptr;
+  j->block_start = start;
+  j->block_len = len;
+  j->nstubs = 0;
+
+  int i, p = start;
+  for (i=0; i < (len ? len : JIT_MAX_INS) && i < JIT_MAX_INS; i++)
+    {
+      decoded *e = &m->icache[p];
+      if (!jit_supported(e))
+	break;
+      jit_ins(j, p, e);
+      if (e->ends_block)
+	break;
+      p = (p+1) & 07777;
+    }
+  if (i >= JIT_MAX_INS || !m->icache[p].ends_block || !jit_supported(&m->icache[p]))
+    jit_stub(j, -1, JIT_INTERP, p);
+
+  // Exits to the interpreter
+  unsigned char *epilogue_jumps[JIT_MAX_STUBS];
+  for (int k=0; k<j->nstubs; k++)
+    {
+      struct jit_stub *s = &j->stubs[k];
+      jit_patch(s->patch, j->ptr);
+      int field = (s->status == JIT_OVERFLOW) ? offsetof(struct jit_state, prev_ip) : offsetof(struct jit_state, ip);
+      jit_rm(j, 0, 0xc7, 0, R15, -1, 0, field);
+      jit_long(j, s->addr);
+      jit_byte(j, 0xb8);			// mov eax, status
+      jit_long(j, s->status);
+      epilogue_jumps[k] = jit_jump_rel32(j, -1);
+    }
+
+  for (int k=0; k<j->nstubs; k++)
+    jit_patch(epilogue_jumps[k], j->ptr);
+  jit_rm(j, 1, JIT_MOV_STORE, RBX, R15, -1, 0, st_acc);
+  jit_rm(j, 1, JIT_MOV_STORE, R12, R15, -1, 0, st_r1);
+  for (int i=5; i>=0; i--)
+    jit_push_pop(j, 0x58, saved[i]);
+  jit_byte(j, 0xc3);			// ret
+  assert(j->ptr <= code + JIT_MAX_CODE);
+
+  if (mprotect(j->buf, JIT_BUF_SIZE, PROT_READ | PROT_EXEC) < 0)
+    {
+      j->broken = 1;
+      return NULL;
+    }
+  return (jit_code) code;
+}
+
+/*
+ *  Called by the engine after entering the block at ip through a jump.
+ *  Returns 1 if native code ran and jumped to another block, 0 if the
+ *  interpreter should go on at ip (unless the machine stopped).
+ */
+static int jit_run(struct minsk_machine *m)
+{
+  decoded *d = &m->icache[m->ip];
+  if (!d->valid)
+    return 0;
+  if (d->jit_gen != m->code_gen)
+    {
+      d->jit = NULL;
+      d->jit_gen = m->code_gen;
+      d->heat = 0;
+    }
+  if (!d->jit)
+    {
+      if (d->heat >= JIT_THRESHOLD || ++d->heat < JIT_THRESHOLD)
+	return 0;
+      m->host = HOST_TRANSLATE;
+      d->jit = jit_translate(m, m->ip);
+      m->host = HOST_INTERP;
+      d->jit_gen = m->code_gen;
+      if (!d->jit)
+	return 0;
+    }
+
+  native_mark(m);
+
+  struct jit_state s = {
+    .acc = m->acc,
+    .r1 = m->r1,
+    .r2 = m->r2,
+    .quota = m->cpu_quota,
+    .effects = m->effects,
+    .quiet = m->loop_check ? m->loop.quiet : ~0ULL,
+    .nocheck = m->loop_check ? 0 : ~0ULL,
+    .mem = m->mem,
+    .icache = m->icache,
+  };
+  m->host = HOST_JIT;
+  int status = d->jit(&s);
+  m->host = HOST_INTERP;
+  m->acc = s.acc;
+  m->r2 = s.acc;
+  m->r1 = s.r1;
+  m->cpu_quota = s.quota;
+  m->effects = s.effects;
+  if (m->loop_check)
+    m->loop.quiet = s.quiet;
+  switch (status)
+    {
+    case JIT_JUMP:
+      m->ip = s.ip;
+      m->prev_ip = s.prev_ip;
+      m->r2 = s.r2;
+      return 1;
+    case JIT_INTERP:
+      m->ip = s.ip;
+      return 0;
+    default:
+      native_overflow(m, s.prev_ip);
+      return 0;
+    }
+}
+
+#else
+
+static int jit_run(struct minsk_machine *m UNUSED)
+{
+  return 0;
+}
+
+static void jit_free(struct minsk_machine *m UNUSED)
+{
+}
+
+#endif
+
+/*** Ahead-of-time translation ***/
+
+/*
+ *  minsk_translate() writes a program as C: every instruction reachable
+ *  from the start along fall-through and jumps gets a label and its
+ *  semantics inlined, with the same checks as the JIT does (CPU quota per
+ *  block, stores to code, overflow). The program
+ *  compiled from it links with this library, loads the memory image and
+ *  lets the engines charging per block call its function wherever they
+ *  would call the JIT. When the program changes a cell of translated code,
+ *  all blocks containing the cell become stale and the interpreter runs
+ *  them from then on. The only exception are the cells where subroutine
+ *  calls store their return jumps: the translated code reads them when it
+ *  gets there and looks the target up among the blocks it can enter.
+ */
+
+static void aot_changed(struct minsk_machine *m, int addr, word val)
+{
+  const unsigned char *flags = m->aot->t->flags;
+  if (!(flags[addr] & MINSK_NATIVE_CODE))
+    return;
+  int set = AOT_CHANGED, clear = 0;
+  if (flags[addr] & MINSK_NATIVE_LINK)
+    {
+      // Return addresses end their blocks as long as they hold plain jumps
+      if ((val >> 24) == 0130 << 6)
+	set = 0, clear = AOT_NO_RETURN;
+      else
+	set = AOT_NO_RETURN;
+    }
+
+  // Blocks are straight runs of code, so all we need is to walk back to the end of the previous one
+  for (int n=0; n<MEM_SIZE; n++)
+    {
+      if (flags[addr] & MINSK_NATIVE_ENTRY)
+	m->aot->stale[addr] = (m->aot->stale[addr] & ~clear) | set;
+      addr = (addr-1) & 07777;
+      if ((flags[addr] & (MINSK_NATIVE_CODE | MINSK_NATIVE_END)) != MINSK_NATIVE_CODE)
+	break;
+    }
+}
+
+// Called by translated code after it changed a cell of code
+static void aot_code_changed(struct minsk_machine *m, int addr)
+{
+  if (m->icache[addr].valid)
+    {
+      m->icache[addr].valid = 0;
+      m->code_gen++;
+    }
+  aot_changed(m, addr, m->mem[addr]);
+}
+
+// Like jit_run(), but returns -1 if there is no translation of the block at ip
+static int aot_run(struct minsk_machine *m)
+{
+  struct aot *a = m->aot;
+  if (!(a->t->flags[m->ip] & MINSK_NATIVE_ENTRY) || a->stale[m->ip])
+    return -1;
+
+  native_mark(m);
+
+  struct minsk_native_state s = {
+    .acc = m->acc,
+    .r1 = m->r1,
+    .r2 = m->r2,
+    .quota = m->cpu_quota,
+    .effects = m->effects,
+    .quiet = m->loop_check ? m->loop.quiet : ~0ULL,
+    .loop_check = m->loop_check,
+    .mem = m->mem,
+    .watch = a->watch,
+    .stale = a->stale,
+    .machine = m,
+    .changed = aot_code_changed,
+    .ip = m->ip,
+    .block_end = m->block_end,
+  };
+  m->host = HOST_JIT;
+  int status = a->t->run(&s);
+  m->host = HOST_INTERP;
+  m->acc = s.acc;
+  m->r2 = s.acc;
+  m->r1 = s.r1;
+  m->cpu_quota = s.quota;
+  m->effects = s.effects;
+  if (m->loop_check)
+    m->loop.quiet = s.quiet;
+  m->block_end = s.block_end;
+  switch (status)
+    {
+    case MINSK_NATIVE_JUMP:
+      m->ip = s.ip;
+      m->prev_ip = s.prev_ip;
+      m->r2 = s.r2;
+      return 1;
+    case MINSK_NATIVE_INTERP:
+      m->ip = s.ip;
+      return 0;
+    default:
+      native_overflow(m, s.prev_ip);
+      return 0;
+    }
+}
+
+// Called by the engine instead of jit_run(), with the same meaning of the result
+static int native_run(struct minsk_machine *m)
+{
+  if (m->aot)
+    {
+      int r = aot_run(m);
+      if (r >= 0)
+	return r;
+    }
+  return jit_run(m);
+}
+
+// Targets of jumps by the instruction at p, and the next instruction if the block ending with it falls through
+static int aot_targets(decoded *d, int p, int *t)
+{
+  int next = (p+1) & 07777;
+  switch (d->op)
+    {
+    case 0120:
+      t[0] = d->x.address;
+      t[1] = next;
+      return d->ix ? 2 : 0;
+    case 0130:
+    case 0133:
+      t[0] = d->x.address;
+      return 1;
+    case 0131:
+      t[0] = d->x.address;
+      t[1] = next;			// Where the subroutine returns
+      return 2;
+    case 0132:
+    case 0134:
+      t[0] = d->x.address;
+      t[1] = d->y.address;
+      return 2;
+    case 0135:
+      t[0] = d->y.address;
+      return 1;
+    case 0162:
+      t[0] = next;
+      return 1;
+    default:
+      return 0;
+    }
+}
+
+static int aot_supported(decoded *d)
+{
+  if (d->x.block || d->y.block)
+    return 0;
+  switch (d->op)
+    {
+    case 000:
+    case 004 ... 077:
+    case 0110 ... 0112:
+    case 0114:
+    case 0130 ... 0135:
+    case 0170 ... 0171:
+      return 1;
+    case 0120:
+      return d->ix != 0 && !d->idiom;	// Idioms run faster as a whole (see bulk_loop())
+    default:
+      return 0;
+    }
+}
+
+// Like block_length(), but return addresses end blocks too
+static int aot_length(const unsigned char *flags, int addr)
+{
+  for (int len=1; len<=MEM_SIZE; len++)
+    {
+      if (flags[addr] & MINSK_NATIVE_END)
+	return len;
+      addr = (addr+1) & 07777;
+    }
+  return 0;
+}
+
+static void aot_goto(FILE *out, const unsigned char *flags, int addr)
+{
+  if (flags[addr] & MINSK_NATIVE_ENTRY)
+    fprintf(out, "goto e%04o;", addr);
+  else
+    fprintf(out, "EXIT(MINSK_NATIVE_JUMP, 0%04o);", addr);
+}
+
+static void aot_ins(FILE *out, struct minsk_machine *m, int p, const unsigned char *flags)
+{
+  decoded *d = &m->icache[p];
+  int op = d->op;
+  word w = m->mem[p];
+  char x[16], y[16];			// Operand addresses...
+  char rx[16], ry[16];			// ... and how to read them (cell 0 reads as zero)
+
+  fprintf(out, "  // @%04o  %c%02o %02o %04o %04o\n", p, (w & SIGN_MASK) ? '-' : '+',
+    (int)((w >> 30) & 077), (int)((w >> 24) & 077), d->x.address, d->y.address);
+  if (flags[p] & MINSK_NATIVE_LINK)
+    {
+      // Whatever return jump the last call stored here
+      fprintf(out, "  {\n    minsk_word w = mem[0%04o];\n", p);
+      fprintf(out, "    if ((w >> 24) != 0130 << 6)\n      EXIT(MINSK_NATIVE_INTERP, 0%04o);\n", p);
+      fprintf(out, "    r2 = acc;\n    prev_ip = 0%04o;\n", p);
+      fprintf(out, "    int y = w & 07777;\n");
+      fprintf(out, "    STORE(y, acc, 0%04o, 0%04o);\n", p, p);
+      fprintf(out, "    t = (w >> 12) & 07777;\n    goto jump;\n  }\n");
+      return;
+    }
+  if (!aot_supported(d))
+    {
+      fprintf(out, "  EXIT(MINSK_NATIVE_INTERP, 0%04o);\n", p);
+      return;
+    }
+
+  int end = p;
+  for (int n=0; n<MEM_SIZE && !(flags[end] & MINSK_NATIVE_END); n++)
+    end = (end+1) & 07777;
+
+  fprintf(out, "  {\n");
+  if (op >= 0120)
+    fprintf(out, "    r2 = acc;\n    prev_ip = 0%04o;\n", p);
+  sprintf(x, "0%04o", d->x.address);
+  sprintf(y, "0%04o", d->y.address);
+  sprintf(rx, d->x.address ? "mem[0%04o]" : "0", d->x.address);
+  sprintf(ry, d->y.address ? "mem[0%04o]" : "0", d->y.address);
+  if (d->indexed && op != 000 && (op < 0120 || op >= 0170))
+    {
+      // Declare only the operands used, so that the C compiler does not warn
+      int use_y = op >= 0100 || !(op & 2) || (op & 1);
+      fprintf(out, "    minsk_word i = mem[0%02o];\n", d->ix);
+      fprintf(out, "    int x = (0%04o + (int)((i >> 12) & 07777)) & 07777;\n", d->x.address);
+      strcpy(x, "x");
+      strcpy(rx, "RD(x)");
+      if (use_y)
+	{
+	  fprintf(out, "    int y = (0%04o + (int)(i & 07777)) & 07777;\n", d->y.address);
+	  strcpy(y, "y");
+	  strcpy(ry, "RD(y)");
+	}
+    }
+
+  switch (op)
+    {
+    case 000:
+      break;
+    case 004 ... 077:
+    case 0170 ... 0171:
+      if ((op & 2) && op < 0100)
+	fprintf(out, "    minsk_word a = acc, b = %s, c;\n", rx);
+      else
+	fprintf(out, "    minsk_word a = %s, b = %s, c;\n", ry, rx);
+      if (op < 0100 && (op & ~3) == 004)
+	fprintf(out, "    c = a ^ b;\n");
+      else if (op < 0100 && (op & ~3) == 070)
+	fprintf(out, "    c = a & b;\n");
+      else if (op < 0100 && (op & ~3) == 074)
+	fprintf(out, "    c = a | b;\n");
+      else if (op < 0100 && ((op & ~3) == 010 || (op & ~3) == 020 || (op & ~3) == 050))
+	{
+	  if ((op & ~3) == 050)
+	    fprintf(out, "    long long cc = (long long)(a & VAL) - (long long)(b & VAL);\n");
+	  else
+	    fprintf(out, "    long long cc = TOLL(a) %c TOLL(b);\n", (op & ~3) == 010 ? '+' : '-');
+	  fprintf(out, "    if (!IN_RANGE(cc))\n      OVER(0%04o, b);\n", p);
+	  fprintf(out, "    c = FROMLL(cc);\n");
+	}
+      else
+	{
+	  fprintf(out, "    c = minsk_arith(0%o, a, b);\n", op);
+	  fprintf(out, "    if (c == MINSK_ARITH_OVERFLOW)\n      OVER(0%04o, b);\n", p);
+	}
+      fprintf(out, "    acc = c;\n    r1 = b;\n");
+      if (op < 0100 && (op & 1))
+	fprintf(out, "    STORE(%s, c, 0%04o, 0%04o);\n", y, p, end);
+      break;
+    case 0110 ... 0112:
+    case 0114:
+      fprintf(out, "    minsk_word b = %s, c = ", rx);
+      if (op == 0114)
+	fprintf(out, "%s ^ (b & SIGN);\n", ry);
+      else
+	fprintf(out, "%s;\n", (op == 0110) ? "b" : (op == 0111) ? "b ^ SIGN" : "b & VAL");
+      fprintf(out, "    acc = c;\n    r1 = b;\n");
+      fprintf(out, "    STORE(%s, c, 0%04o, 0%04o);\n", y, p, end);
+      break;
+    case 0120:
+      fprintf(out, "    minsk_word b = mem[0%02o], n = (b >> 24) & 017777;\n", d->ix);
+      fprintf(out, "    if (!n)\n      {\n\tr1 = b;\n\t");
+      aot_goto(out, flags, (p+1) & 07777);
+      fprintf(out, "\n      }\n");
+      fprintf(out, "    minsk_word a = %s, c = ((n-1) << 24) | ((((b >> 12) + (a >> 12)) & 07777) << 12) | ((b + a) & 07777);\n", ry);
+      fprintf(out, "    acc = c;\n    r1 = b;\n");
+      fprintf(out, "    STORE(0%02o, c, 0%04o, 0%04o);\n    ", d->ix, p, end);
+      aot_goto(out, flags, d->x.address);
+      fprintf(out, "\n");
+      break;
+    case 0130:
+      fprintf(out, "    STORE(0%04o, acc, 0%04o, 0%04o);\n    ", d->y.address, p, end);
+      aot_goto(out, flags, d->x.address);
+      fprintf(out, "\n");
+      break;
+    case 0131:
+      fprintf(out, "    acc = 0%llo;\n", (0130ULL << 30) | (((p+1) & 07777ULL) << 12));
+      fprintf(out, "    STORE(0%04o, acc, 0%04o, 0%04o);\n    ", d->y.address, p, end);
+      aot_goto(out, flags, d->x.address);
+      fprintf(out, "\n");
+      break;
+    case 0132:
+    case 0134:
+      fprintf(out, "    if (acc & %s)\n      ", (op == 0132) ? "SIGN" : "VAL");
+      aot_goto(out, flags, (op == 0132) ? d->y.address : d->x.address);
+      fprintf(out, "\n    ");
+      aot_goto(out, flags, (op == 0132) ? d->x.address : d->y.address);
+      fprintf(out, "\n");
+      break;
+    case 0133:
+    case 0135:
+      fprintf(out, "    ");
+      aot_goto(out, flags, (op == 0133) ? d->x.address : d->y.address);
+      fprintf(out, "\n");
+      break;
+    }
+  fprintf(out, "  }\n");
+}
+
+static const char aot_prologue[] =
+  "/*\n"
+  " *  Minsk program translated to C by minsk --translate\n"
+  " *\n"
+  " *  Build it with libminsk.a: cc -O2 -I<minsk> prog.c <minsk>/libminsk.a -lpthread\n"
+  " */\n"
+  "\n"
+  "#include \"minsk.h\"\n"
+  "\n"
+  "#include <stdio.h>\n"
+  "#include <stdlib.h>\n"
+  "#include <unistd.h>\n"
+  "\n"
+  "#define SIGN 01000000000000ULL\n"
+  "#define VAL 00777777777777ULL\n"
+  "#define TOLL(w) (((w) & SIGN) ? -(long long)((w) & VAL) : (long long)((w) & VAL))\n"
+  "#define FROMLL(x) (((x) < 0) ? (minsk_word)(-(x)) | SIGN : (minsk_word)(x))\n"
+  "#define IN_RANGE(x) ((x) >= -(long long)VAL && (x) <= (long long)VAL)\n"
+  "#define RD(a) ((a) ? mem[a] : 0)\t\t// Cell 0 reads as zero\n"
+  "\n"
+  "// Return to the interpreter, which goes on at p\n"
+  "#define EXIT(status, p) do {\t\t\\\n"
+  "    s->acc = acc;\t\t\t\\\n"
+  "    s->r1 = r1;\t\t\t\t\\\n"
+  "    s->r2 = r2;\t\t\t\t\\\n"
+  "    s->prev_ip = prev_ip;\t\t\\\n"
+  "    s->quota = quota;\t\t\t\\\n"
+  "    s->effects = effects;\t\t\\\n"
+  "    s->quiet = quiet;\t\t\t\\\n"
+  "    s->block_end = block_end;\t\t\\\n"
+  "    s->ip = (p);\t\t\t\\\n"
+  "    return (status);\t\t\t\\\n"
+  "  } while (0)\n"
+  "\n"
+  "// Overflow of the instruction at p, whose operand from x was b\n"
+  "#define OVER(p, b) do {\t\t\t\\\n"
+  "    r1 = (b);\t\t\t\t\\\n"
+  "    prev_ip = (p);\t\t\t\\\n"
+  "    EXIT(MINSK_NATIVE_OVERFLOW, p);\t\\\n"
+  "  } while (0)\n"
+  "\n"
+  "// Store by the instruction at p, whose block ends at end. If it changes code later\n"
+  "// in the block, the interpreter goes on with the next instruction.\n"
+  "#define STORE(a, v, p, end) do {\t\t\t\\\n"
+  "    if (mem[a] != (v))\t\t\t\t\\\n"
+  "      {\t\t\t\t\t\t\\\n"
+  "\teffects++;\t\t\t\t\\\n"
+  "\tmem[a] = (v);\t\t\t\t\\\n"
+  "\tif (s->watch[a])\t\t\t\\\n"
+  "\t  {\t\t\t\t\t\\\n"
+  "\t    s->changed(s->machine, a);\t\t\\\n"
+  "\t    if ((((a) - (p) - 1) & 07777) < (((end) - (p)) & 07777))\t\\\n"
+  "\t      EXIT(MINSK_NATIVE_INTERP, ((p) + 1) & 07777);\t\\\n"
+  "\t  }\t\t\t\t\t\\\n"
+  "      }\t\t\t\t\t\t\\\n"
+  "  } while (0)\n"
+  "\n"
+  "// Jump to the block of len instructions at p, charging the CPU quota. Unless the block\n"
+  "// before changed a cell, let the interpreter look for an infinite loop first.\n"
+  "#define ENTER(p, len) do {\t\t\\\n"
+  "    if (s->stale[p] || effects == quiet)\t\\\n"
+  "      EXIT(MINSK_NATIVE_JUMP, p);\t\\\n"
+  "    if (quota > 0)\t\t\t\\\n"
+  "      {\t\t\t\t\t\\\n"
+  "\tif (quota <= (len))\t\t\\\n"
+  "\t  EXIT(MINSK_NATIVE_JUMP, p);\t\\\n"
+  "\tquota -= (len);\t\t\t\\\n"
+  "\tblock_end = ((p) + (len) - 1) & 07777;\t\\\n"
+  "      }\t\t\t\t\t\\\n"
+  "    quiet = effects ^ nocheck;\t\t\\\n"
+  "  } while (0)\n"
+  "\n";
+
+static const char aot_epilogue[] =
+  "static const struct minsk_translation translation = { image, flags, run };\n"
+  "\n"
+  "int main(int argc, char **argv)\n"
+  "{\n"
+  "  int english = 0, cpu_quota = -1, print_quota = -1, loop_check = 1;\n"
+  "  int opt;\n"
+  "\n"
+  "  while ((opt = getopt(argc, argv, \"eq:p:L\")) >= 0)\n"
+  "    switch (opt)\n"
+  "      {\n"
+  "      case 'e':\n"
+  "\tenglish = 1;\n"
+  "\tbreak;\n"
+  "      case 'q':\n"
+  "\tcpu_quota = atoi(optarg);\n"
+  "\tbreak;\n"
+  "      case 'p':\n"
+  "\tprint_quota = atoi(optarg);\n"
+  "\tbreak;\n"
+  "      case 'L':\n"
+  "\tloop_check = 0;\n"
+  "\tbreak;\n"
+  "      default:\n"
+  "\tfprintf(stderr, \"Usage: %s [-e] [-q <cpu-quota>] [-p <print-quota>] [-L]\\n\", argv[0]);\n"
+  "\treturn 1;\n"
+  "      }\n"
+  "\n"
+  "  struct minsk_machine *m = minsk_new(MEMBLOCKS);\n"
+  "  if (!m)\n"
+  "    {\n"
+  "      fprintf(stderr, \"Out of memory\\n\");\n"
+  "      return 1;\n"
+  "    }\n"
+  "  minsk_set_cpu_quota(m, cpu_quota);\n"
+  "  minsk_set_print_quota(m, print_quota);\n"
+  "  minsk_set_loop_check(m, loop_check);\n"
+  "  for (int i=0; i<4096; i++)\n"
+  "    if (image[i])\n"
+  "      minsk_write(m, 0, i, image[i]);\n"
+  "  for (const struct cell *c = more_image; c->block; c++)\n"
+  "    minsk_write(m, c->block, c->address, c->w);\n"
+  "  if (!minsk_set_translation(m, &translation))\n"
+  "    {\n"
+  "      fprintf(stderr, \"Out of memory\\n\");\n"
+  "      return 1;\n"
+  "    }\n"
+  "\n"
+  "  minsk_run(m);\n"
+  "  minsk_report(m, stdout, english);\n"
+  "  fflush(stdout);\n"
+  "  switch (minsk_status(m))\n"
+  "    {\n"
+  "    case MINSK_OVERFLOW:\n"
+  "    case MINSK_NOT_IMPLEMENTED:\n"
+  "    case MINSK_ILLEGAL:\n"
+  "      minsk_dump_recorder(m, stderr, english);\n"
+  "      break;\n"
+  "    default: ;\n"
+  "    }\n"
+  "  minsk_free(m);\n"
+  "  return 0;\n"
+  "}\n";
+
+static void translate(struct minsk_machine *m, FILE *out)
+{
+  unsigned char flags[MEM_SIZE];
+  int queue[MEM_SIZE], qlen = 0;
+  char target[MEM_SIZE];		// Entered by a jump in translated code
+  int links = 0;
+
+  // Find the code: straight runs from the start and from every jump target
+  memset(flags, 0, sizeof(flags));
+  flags[m->ip] = MINSK_NATIVE_ENTRY;
+  queue[qlen++] = m->ip;
+  while (qlen)
+    {
+      int p = queue[--qlen];
+      for (int n=0; n<MEM_SIZE && !(flags[p] & MINSK_NATIVE_CODE); n++)
+	{
+	  decoded *d = &m->icache[p];
+	  if (!d->valid)
+	    decode(m, p);
+	  flags[p] |= MINSK_NATIVE_CODE;
+	  if (flags[p] & MINSK_NATIVE_LINK)
+	    break;
+	  if (d->ends_block)
+	    {
+	      int t[2];
+	      for (int i = aot_targets(d, p, t); i--; )
+		if (!(flags[t[i]] & MINSK_NATIVE_ENTRY))
+		  {
+		    flags[t[i]] |= MINSK_NATIVE_ENTRY;
+		    queue[qlen++] = t[i];
+		  }
+	      flags[p] |= MINSK_NATIVE_END;
+	      if (d->op == 0131 && aot_supported(d))
+		{
+		  // Where the subroutine returns by the jump stored here, whatever is there now
+		  flags[d->y.address] |= MINSK_NATIVE_LINK | MINSK_NATIVE_END;
+		}
+	      break;
+	    }
+	  p = (p+1) & 07777;
+	}
+    }
+
+  // Blocks which run all around the memory have no length to charge
+  memset(target, 0, sizeof(target));
+  for (int p=0; p<MEM_SIZE; p++)
+    if (!(flags[p] & MINSK_NATIVE_CODE))
+      flags[p] = 0;			// Return address of a subroutine never reached
+    else if (flags[p] & MINSK_NATIVE_LINK)
+      links = 1;
+  for (int p=0; p<MEM_SIZE; p++)
+    if ((flags[p] & MINSK_NATIVE_ENTRY) && !aot_length(flags, p))
+      flags[p] &= ~MINSK_NATIVE_ENTRY;
+  for (int p=0; p<MEM_SIZE; p++)
+    if ((flags[p] & MINSK_NATIVE_END) && aot_supported(&m->icache[p]) && m->icache[p].op != 0162)
+      {
+	int t[2];
+	for (int i = aot_targets(&m->icache[p], p, t); i--; )
+	  if ((flags[t[i]] & MINSK_NATIVE_ENTRY) && !(m->icache[p].op == 0131 && i))
+	    target[t[i]] = 1;
+      }
+  if (links)
+    for (int p=0; p<MEM_SIZE; p++)
+      if (flags[p] & MINSK_NATIVE_ENTRY)
+	target[p] = 1;
+
+  fputs(aot_prologue, out);
+  fprintf(out, "#define MEMBLOCKS %d\n\n", m->memblocks);
+  fprintf(out, "static const minsk_word image[4096] = {\n");
+  for (int p=0; p<MEM_SIZE; p++)
+    if (m->mem[p])
+      fprintf(out, "  [0%04o] = 0%llo,\n", p, m->mem[p]);
+  fprintf(out, "};\n\n");
+  fprintf(out, "static const struct cell { int block, address; minsk_word w; } more_image[] = {\n");
+  for (int i=MEM_SIZE; i < m->memblocks * MEM_SIZE; i++)
+    if (m->mem[i])
+      fprintf(out, "  { %d, 0%04o, 0%llo },\n", i / MEM_SIZE, i % MEM_SIZE, m->mem[i]);
+  fprintf(out, "  { 0, 0, 0 },\n};\n\n");
+  fprintf(out, "static const unsigned char flags[4096] = {\n");
+  for (int p=0; p<MEM_SIZE; p++)
+    if (flags[p])
+      fprintf(out, "  [0%04o] = %d,\n", p, flags[p]);
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "static int run(struct minsk_native_state *s)\n{\n");
+  fprintf(out, "  minsk_word acc = s->acc, r1 = s->r1, r2 = s->r2;\n");
+  fprintf(out, "  int prev_ip = s->prev_ip;\t\t// Set with r2 by jumps, as the interpreter leaves them\n");
+  for (int p=0; p<MEM_SIZE; p++)
+    if ((flags[p] & MINSK_NATIVE_CODE) && aot_supported(&m->icache[p]) && m->icache[p].op != 000 &&
+	!(m->icache[p].op >= 0132 && m->icache[p].op <= 0135))
+      {
+	fprintf(out, "  minsk_word *mem = s->mem;\n");
+	break;
+      }
+  fprintf(out, "  long long quota = s->quota;\n");
+  fprintf(out, "  unsigned long long effects = s->effects;\n");
+  if (memchr(target, 1, MEM_SIZE))
+    fprintf(out, "  unsigned long long nocheck = s->loop_check ? 0 : ~0ULL;\n");
+  fprintf(out, "  unsigned long long quiet = s->quiet;\n");
+  fprintf(out, "  int block_end = s->block_end;\n");
+  if (links)
+    fprintf(out, "  int t;\t\t\t\t// Target of a return jump\n");
+  fprintf(out, "\n");
+  fprintf(out, "  switch (s->ip)\n    {\n");
+  for (int p=0; p<MEM_SIZE; p++)
+    if (flags[p] & MINSK_NATIVE_ENTRY)
+      fprintf(out, "    case 0%04o: goto c%04o;\n", p, p);
+  fprintf(out, "    default: EXIT(MINSK_NATIVE_INTERP, s->ip);\n    }\n\n");
+
+  for (int p=0; p<MEM_SIZE; p++)
+    if (flags[p] & MINSK_NATIVE_CODE)
+      {
+	if ((flags[p] & MINSK_NATIVE_ENTRY) || !p && (flags[07777] & (MINSK_NATIVE_CODE | MINSK_NATIVE_END)) == MINSK_NATIVE_CODE)
+	  fprintf(out, "c%04o:\n", p);
+	aot_ins(out, m, p, flags);
+	if (p == 07777 && !(flags[p] & MINSK_NATIVE_END))
+	  fprintf(out, "  goto c0000;\n");
+      }
+
+  // Jumps enter blocks through their labels here, which charge the CPU quota
+  fprintf(out, "\n");
+  if (links)
+    {
+      fprintf(out, "jump:\n  switch (t)\n    {\n");
+      for (int p=0; p<MEM_SIZE; p++)
+	if (target[p])
+	  fprintf(out, "    case 0%04o: goto e%04o;\n", p, p);
+      fprintf(out, "    default: EXIT(MINSK_NATIVE_JUMP, t);\n    }\n\n");
+    }
+  for (int p=0; p<MEM_SIZE; p++)
+    if (target[p])
+      fprintf(out, "e%04o:\n  ENTER(0%04o, %d);\n  goto c%04o;\n", p, p, aot_length(flags, p), p);
+  fprintf(out, "}\n\n");
+  fputs(aot_epilogue, out);
+}
+
+/*
+ *  Profiling counts executions of every instruction and every opcode,
+ *  and jumps (instructions not followed by the next one) by their source
+ *  and target. A jump instruction has at most
+ *  two targets unless the program rewrites it, so every source address
+ *  has two slots for them and the rest is just counted.
+ */
+
+struct profile_edge
+{
+  unsigned short to[2];
+  unsigned long long count[2];
+  unsigned long long other;
+};
+
+struct profile
+{
+  unsigned long long ins[MEM_SIZE];
+  unsigned long long ops[0201];		// Including 0200 for instructions invalid on this machine
+  struct profile_edge edges[MEM_SIZE];
+  double seconds;			// Time spent running
+  int last_ip;				// Last instruction counted (-1 at the start of a run)
+};
+
+static void profile_jump(struct profile *p, int from, int to)
+{
+  struct profile_edge *e = &p->edges[from];
+  for (int i=0; i<2; i++)
+    if (!e->count[i] || e->to[i] == to)
+      {
+	e->to[i] = to;
+	e->count[i]++;
+	return;
+      }
+  e->other++;
+}
+
+/*
+ *  The sampling profiler lets a POSIX timer measuring the CPU time of the
+ *  thread running the machine send SIGPROF to the thread, whose handler
+ *  counts the instruction being executed (or the first instruction of the
+ *  block being run by translated code) and what the emulator is doing.
+ *  The emulator itself pays nothing but a few stores when it switches
+ *  between interpreting, running translated code and printing.
+ */
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+struct sampler
+{
+  unsigned int samples[HOST_MAX][MEM_SIZE];
+  int hz;
+  timer_t timer;			// While minsk_run() runs
+};
+
+static const char * const host_names[HOST_MAX] = {
+  [HOST_INTERP] = "interpreter",
+  [HOST_TRACE] = "tracer",
+  [HOST_PROFILE] = "profiler",
+  [HOST_JIT] = "jit",
+  [HOST_TRANSLATE] = "translator",
+  [HOST_PRINT] = "printer",
+};
+
+static __thread struct minsk_machine *sampled_machine;
+
+static void sample(int sig UNUSED)
+{
+  struct minsk_machine *m = sampled_machine;
+  if (!m)
+    return;
+
+  int host = m->host;
+  // Translated code updates only ip, the interpreter sets prev_ip to the current instruction
+  int ip = (host == HOST_JIT || host == HOST_TRANSLATE) ? m->ip : m->prev_ip;
+  // CPU-time timers fire on scheduler ticks, so several periods can expire at once
+  int e = errno;
+  int overrun = timer_getoverrun(m->sampler->timer);
+  m->sampler->samples[host][ip & 07777] += 1 + (overrun > 0 ? overrun : 0);
+  errno = e;
+}
+
+static int sample_start(struct minsk_machine *m)
+{
+  timer_t *timer = &m->sampler->timer;
+  struct sigevent sev = {
+    .sigev_notify = SIGEV_THREAD_ID,
+    .sigev_signo = SIGPROF,
+  };
+  sev.sigev_notify_thread_id = gettid();
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, timer) < 0)
+    return 0;
+
+  long ns = 1000000000 / m->sampler->hz;
+  struct itimerspec its = {
+    .it_interval = { ns / 1000000000, ns % 1000000000 },
+    .it_value = { ns / 1000000000, ns % 1000000000 },
+  };
+  sampled_machine = m;
+  if (timer_settime(*timer, 0, &its, NULL) < 0)
+    {
+      timer_delete(*timer);
+      sampled_machine = NULL;
+      return 0;
+    }
+  return 1;
+}
+
+static void sample_stop(struct minsk_machine *m)
+{
+  timer_delete(m->sampler->timer);
+  sampled_machine = NULL;		// Signals still pending find no machine
+}
+
+/*
+ *  The interpreter loop. With ENABLE_THREADED_DISPATCH, the handler of
+ *  every instruction fetches the next instruction itself and jumps to its
+ *  handler through a table of label addresses (GCC's computed goto), so the
+ *  branch predictor sees a separate indirect jump after every opcode.
+ *  Otherwise, all instructions share a single switch.
+ *
+ *  The loop itself lives in engine.h, which is instantiated once per trace
+ *  level, so the engine used without tracing contains no tracing code.
+ *  That one also comes in a variant charging the CPU quota per block,
+ *  and both are built twice: for the Minsk-2, where memory blocks do not
+ *  exist, and for the Minsk-22.
+ */
+
+#define RD(addr) mem_rd(m, addr, TRACING, MINSK22)
+#define WR(addr, val) mem_wr(m, addr, val, TRACING, MINSK22)
+
+static ALWAYS_INLINE decoded *fetch(struct minsk_machine *m, loc *xi, loc *yi, const int tracing, const int blocks, const int profile, const int minsk22)
+{
+  m->r2 = m->acc;
+  m->prev_ip = m->ip;
+  decoded *d = &m->icache[m->ip];
+  if (!d->valid)
+    {
+      decode(m, m->ip);
+      if (blocks && m->cpu_quota > 0)
+	{
+	  // The instruction was rewritten after its block had been charged
+	  m->cpu_quota += ((m->block_end - m->ip) & 07777) + 1;
+	  if (!charge_block(m))
+	    return NULL;
+	}
+    }
+
+  if (minsk22)
+    {
+      *xi = d->x;			// (indexed form)
+      *yi = d->y;
+    }
+  else
+    {
+      // decode() rejects address extensions, so both operands are in block 0
+      *xi = (loc) { 0, d->x.address };
+      *yi = (loc) { 0, d->y.address };
+    }
+  if (tracing == TRACE_BINARY)
+    btrace(m, MINSK_TR_INS, d->x, d->y, 0, m->mem[m->ip] | (word) m->ip << 48);
+  else if (tracing)
+    {
+      word w = m->mem[m->ip];
+      fprintf(m->out, "@%04o  %c%02o %02o %d:%04o %d:%04o\n",
+	m->ip,
+	(w & SIGN_MASK) ? '-' : '+',
+	(int)((w >> 30) & 077),
+	(int)((w >> 24) & 077),
+	LF(d->x),
+	LF(d->y));
+    }
+  if (d->indexed)
+    {
+      loc iaddr = { 0, d->ix };
+      word i = mem_rd(m, iaddr, tracing, 0);
+      xi->address = (xi->address + (int)((i >> 12) & 07777)) & 07777;
+      yi->address = (yi->address + (int)(i & 07777)) & 07777;
+      if (tracing > 2)
+	fprintf(m->out, "\tIndexing -> %d:%04o %d:%04o\n", LF(*xi), LF(*yi));
+      else if (tracing == TRACE_BINARY)
+	btrace(m, MINSK_TR_INDEX, *xi, *yi, 0, 0);
+    }
+  m->ip = (m->ip+1) & 07777;
+
+  if (!blocks && m->cpu_quota > 0 && !--m->cpu_quota)
+    {
+      stop(m, MINSK_CPU_QUOTA);
+      return NULL;
+    }
+
+  if (m->rec)
+    record_ins(m, m->prev_ip, *xi, *yi);
+  if (profile)
+    {
+      struct profile *p = m->prof;
+      if (p->last_ip >= 0 && m->prev_ip != ((p->last_ip + 1) & 07777))
+	profile_jump(p, p->last_ip, m->prev_ip);
+      p->last_ip = m->prev_ip;
+      p->ins[m->prev_ip]++;
+      p->ops[d->op]++;
+    }
+  return d;
+}
+
+static ALWAYS_INLINE void trace_regs(struct minsk_machine *m, const int tracing)
+{
+  if (tracing > 1)
+    fprintf(m->out, "\tACC:%c%012llo R1:%c%012llo R2:%c%012llo\n", WF(m->acc), WF(m->r1), WF(m->r2));
+  else if (tracing == TRACE_BINARY)
+    {
+      loc none = { 0, 0 };
+      word regs[3] = { m->acc, m->r1, m->r2 };
+      for (int i=0; i<3; i++)
+	if (regs[i] != m->btrace_regs[i])
+	  {
+	    btrace(m, MINSK_TR_REG, none, none, i, regs[i]);
+	    m->btrace_regs[i] = regs[i];
+	  }
+      btrace(m, MINSK_TR_END, none, none, 0, 0);
+    }
+}
+
+#ifdef ENABLE_THREADED_DISPATCH
+#define OP(o) op_##o:
+#define OPS(lo, hi) op_##lo:
+#define AOPS_DISPATCH(o0, o1, o2, o3) [o0] = &&op_##o0, [o1] = &&op_##o1, [o2] = &&op_##o2, [o3] = &&op_##o3
+#define OP_ILLEGAL op_illegal:
+#define NEXT do { trace_regs(m, TRACING); if (STEP) return MINSK_RUNNING; FETCH; goto *dispatch[op]; } while (0)
+#define FUSION BLOCKS
+#define FUSED_NEXT(o2, next) do { trace_regs(m, TRACING); if (STEP) return MINSK_RUNNING; FETCH; if (d->op == o2) goto op_##next; goto *dispatch[op]; } while (0)
+#define FUSED(f, o2, next, body) op_##f: { body; } FUSED_NEXT(o2, next);
+#define FUSED_AOP(f, o1, o2, next, body) FUSED(f, o2, next, const int this_op = o1; AFETCH; body)
+#define FUSED_DISPATCH(f) [f] = &&op_##f
+// The loop instruction keeps its own handler, fused loops are told apart by op
+#define LOOP_NEXT \
+  if (FUSION && op == FUSED_LOOP_ADD) FUSED_NEXT(011, FUSED_ADD_XOR_LOOP); \
+  else if (FUSION && op == FUSED_LOOP_MOVE) FUSED_NEXT(0110, FUSED_MOVE_ADD_XOR_LOOP); \
+  NEXT
+#else
+#define OP(o) case o:
+#define OPS(lo, hi) case lo ... hi:
+#define OP_ILLEGAL default:
+#define NEXT break
+#define LOOP_NEXT NEXT
+#define FUSION 0			// Superinstructions need threaded code
+#endif
+
+/*
+ *  Arithmetic instructions come in four variants: bit 1 of the opcode takes
+ *  the first operand from R2 instead of memory, bit 0 stores the result back
+ *  to memory. AOPS() expands the handler once per variant with the opcode
+ *  known at compile time, so choosing the variant costs nothing at run time.
+ */
+
+#define AFETCH do { if (this_op & 2) a = m->r2; else a = RD(yi); b = m->r1 = RD(xi); } while (0)
+#define ASTORE(result) do { m->acc = (result); if (this_op & 1) WR(yi, m->acc); } while (0)
+#define ASTORE_INT(x) do { cc = (x); if (!int_in_range(cc)) return over(m); ASTORE(wfromll(cc)); } while (0)
+#define ASTORE_CHECK(w) do { c = (w); if (c == OVERFLOW_WORD) return over(m); ASTORE(c); } while (0)
+
+#define AOP(o, body) OP(o) { const int this_op = o; AFETCH; body; } NEXT;
+#define AOPS(o0, o1, o2, o3, body) AOP(o0, body) AOP(o1, body) AOP(o2, body) AOP(o3, body)
+
+#define FETCH do { if (!(d = fetch(m, &xi, &yi, TRACING, BLOCKS, PROFILE, MINSK22))) return m->status; op = FUSION ? d->fop : d->op; ix = d->ix; x = d->x; y = d->y; } while (0)
+
+#define ENGINE_HOST (PROFILE ? HOST_PROFILE : TRACING ? HOST_TRACE : HOST_INTERP)
+#define ENTER_BLOCK do { if (BLOCKS && ((m->loop_check && loop_check(m)) || (m->cpu_quota > 0 && !charge_block(m)))) return m->status; } while (0)
+#define JIT_TRY do { if (BLOCKS) { while (native_run(m)) ENTER_BLOCK; if (m->status) return m->status; } } while (0)
+
+#define ENGINE run_blocks
+#define TRACING 0
+#define BLOCKS 1
+#define PROFILE 0
+#define STEP 0
+#define MINSK22 0
+#include "engine.h"
+
+#define ENGINE run_notrace
+#define TRACING 0
+#define BLOCKS 0
+#define PROFILE 0
+#define STEP 0
+#define MINSK22 0
+#include "engine.h"
+
+// The Minsk-22 gets its own copy of the engines used without tracing
+#define ENGINE run_blocks22
+#define TRACING 0
+#define BLOCKS 1
+#define PROFILE 0
+#define STEP 0
+#define MINSK22 1
+#include "engine.h"
+
+#define ENGINE run_notrace22
+#define TRACING 0
+#define BLOCKS 0
+#define PROFILE 0
+#define STEP 0
+#define MINSK22 1
+#include "engine.h"
+
+#define ENGINE run_trace1
+#define TRACING 1
+#define BLOCKS 0
+#define PROFILE 0
+#define STEP 0
+#define MINSK22 1
+#include "engine.h"
+
+#define ENGINE run_trace2
+#define TRACING 2
+#define BLOCKS 0
+#define PROFILE 0
+#define STEP 0
+#define MINSK22 1
+#include "engine.h"
+
+#define ENGINE run_trace3
+#define TRACING 3
+#define BLOCKS 0
+#define PROFILE 0
+#define STEP 0
+#define MINSK22 1
+#include "engine.h"
+
+#define ENGINE run_btrace
+#define TRACING TRACE_BINARY
+#define BLOCKS 0
+#define PROFILE 0
+#define STEP 0
+#define MINSK22 1
+#include "engine.h"
+
+#define ENGINE run_profile
+#define TRACING 0
+#define BLOCKS 0
+#define PROFILE 1
+#define STEP 0
+#define MINSK22 1
+#include "engine.h"
+
+// Profiling combined with tracing is slow anyway, one copy serves all levels
+#define ENGINE run_profile_trace
+#define TRACING TRACE_LEVEL(m)
+#define BLOCKS 0
+#define PROFILE 1
+#define STEP 0
+#define MINSK22 1
+#include "engine.h"
+
+// Single-stepping is not worth a copy per trace level
+#define ENGINE run_step
+#define TRACING TRACE_LEVEL(m)
+#define BLOCKS 0
+#define PROFILE 0
+#define STEP 1
+#define MINSK22 1
+#include "engine.h"
+
+static enum minsk_status run(struct minsk_machine *m)
+{
+  if (m->prof)
+    return TRACE_LEVEL(m) ? run_profile_trace(m) : run_profile(m);
+  else if (m->btrace)
+    return run_btrace(m);
+  else if (m->trace > 2)
+    return run_trace3(m);
+  else if (m->trace > 1)
+    return run_trace2(m);
+  else if (m->trace)
+    return run_trace1(m);
+  else if (m->memblocks > 1)
+    return run_blocks22(m) ? refund_block(m) : run_notrace22(m);
+  else if (run_blocks(m))
+    return refund_block(m);
+  else
+    return run_notrace(m);
+}
+
+/*** Library interface ***/
+
+#define HUGE_PAGE_SIZE (2 << 20)
+
+// Memory is a single arena, page-aligned, or backed by huge pages if it is big enough to fill them
+static word *mem_alloc(int memblocks)
+{
+  size_t size = (size_t) memblocks * MEM_SIZE * sizeof(word);
+  size_t align = (size >= HUGE_PAGE_SIZE) ? HUGE_PAGE_SIZE : 4096;
+  void *p;
+  if (posix_memalign(&p, align, size))
+    return NULL;
+#ifdef MADV_HUGEPAGE
+  if (align == HUGE_PAGE_SIZE)
+    madvise(p, size & ~(size_t) (HUGE_PAGE_SIZE - 1), MADV_HUGEPAGE);
+#endif
+  return p;
+}
+
+struct minsk_machine *minsk_new(int memblocks)
+{
+  struct minsk_machine *m = calloc(1, sizeof(struct minsk_machine));
+  if (!m)
+    return NULL;
+  m->memblocks = memblocks;
+  m->mem = mem_alloc(memblocks);
+  m->icache = calloc(MEM_SIZE, sizeof(decoded));
+  if (!m->mem || !m->icache)
+    goto fail;
+
+  m->out = stdout;
+  m->cpu_limit = -1;
+  m->print_limit = -1;
+  m->flush_lines = 1;
+  m->loop_check = 1;
+  if (!minsk_set_recorder(m, 16))
+    goto fail;
+  minsk_reset(m);
+  return m;
+
+fail:
+  minsk_free(m);
+  return NULL;
+}
+
+void minsk_free(struct minsk_machine *m)
+{
+  if (!m)
+    return;
+  free(m->mem);
+  free(m->icache);
+  free(m->rec);
+  free(m->prof);
+  free(m->sampler);
+  jit_free(m);
+  free(m->aot);
+  free(m);
+}
+
+void minsk_reset(struct minsk_machine *m)
+{
+  memset(m->mem, 0, m->memblocks * MEM_SIZE * sizeof(word));
+  memset(m->icache, 0, MEM_SIZE * sizeof(decoded));
+  m->code_gen = 0;
+#ifdef ENABLE_JIT
+  if (m->jit)
+    m->jit->ptr = m->jit->buf;		// No decoded record points to the old code any longer
+#endif
+  free(m->aot);				// The translation was made for the memory just cleared
+  m->aot = NULL;
+
+  m->acc = m->r1 = m->r2 = 0;
+  m->ip = 00050;			// Standard program start location
+  m->prev_ip = 0;
+  m->cpu_quota = m->cpu_limit;
+  m->print_quota = m->print_limit;
+  m->effects = 0;
+  loop_reset(m);
+  memset(m->linebuf, 0, sizeof(m->linebuf));
+  m->unflushed = 0;
+  m->rec_pos = 0;
+  if (m->prof)
+    memset(m->prof, 0, sizeof(struct profile));
+  if (m->sampler)
+    memset(m->sampler->samples, 0, sizeof(m->sampler->samples));
+  m->status = MINSK_RUNNING;
+  m->lino = 0;
+}
+
+void minsk_set_output(struct minsk_machine *m, FILE *out)
+{
+  m->out = out;
+}
+
+void minsk_set_trace(struct minsk_machine *m, int level)
+{
+  m->trace = level;
+}
+
+void minsk_set_binary_trace(struct minsk_machine *m, FILE *f)
+{
+  if (m->btrace)
+    {
+      btrace_flush(m);
+      fflush(m->btrace);
+    }
+  m->btrace = f;
+  if (f)
+    {
+      uint32_t hdr[2] = { htole32(MINSK_TRACE_VERSION), htole32(sizeof(struct minsk_trace_record)) };
+      fwrite(MINSK_TRACE_MAGIC, 1, 8, f);
+      fwrite(hdr, sizeof(hdr), 1, f);
+      memset(m->btrace_regs, 0, sizeof(m->btrace_regs));
+    }
+}
+
+int minsk_set_recorder(struct minsk_machine *m, int instructions)
+{
+  free(m->rec);
+  m->rec = NULL;
+  m->rec_mask = 0;
+  m->rec_pos = 0;
+  if (instructions <= 0)
+    return 1;
+
+  int size = 1;
+  while (size < instructions)
+    size *= 2;
+  if (!(m->rec = calloc(size, sizeof(record))))
+    return 0;
+  m->rec_mask = size - 1;
+  return 1;
+}
+
+int minsk_set_profile(struct minsk_machine *m, int enable)
+{
+  if (!enable)
+    {
+      free(m->prof);
+      m->prof = NULL;
+    }
+  else if (!m->prof && !(m->prof = calloc(1, sizeof(struct profile))))
+    return 0;
+  return 1;
+}
+
+int minsk_set_sampling(struct minsk_machine *m, int hz)
+{
+  if (hz <= 0)
+    {
+      free(m->sampler);
+      m->sampler = NULL;
+      return 1;
+    }
+  if (!m->sampler && !(m->sampler = calloc(1, sizeof(struct sampler))))
+    return 0;
+  m->sampler->hz = hz;
+
+  // The handler is process-wide, but only the thread running a sampled machine gets the signals
+  struct sigaction sa = { .sa_handler = sample, .sa_flags = SA_RESTART };
+  sigemptyset(&sa.sa_mask);
+  return sigaction(SIGPROF, &sa, NULL) >= 0;
+}
+
+void minsk_set_cpu_quota(struct minsk_machine *m, int instructions)
+{
+  m->cpu_limit = m->cpu_quota = instructions;
+}
+
+void minsk_set_print_quota(struct minsk_machine *m, int lines)
+{
+  m->print_limit = m->print_quota = lines;
+}
+
+void minsk_set_flush(struct minsk_machine *m, int lines)
+{
+  m->flush_lines = lines;
+}
+
+void minsk_set_loop_check(struct minsk_machine *m, int enable)
+{
+  m->loop_check = enable;
+}
+
+void minsk_set_password(struct minsk_machine *m)
+{
+  // For the contest, we fill the whole memory with -00 00 0000 0000 (HALT),
+  // not +00 00 0000 0000 (NOP). Otherwise, an empty program would reveal
+  // the location of the password :)
+  for (int i=0; i<m->memblocks * MEM_SIZE; i++)
+    m->mem[i] = 01000000000000ULL;
+
+  // Store the password
+  int pos = 02655;
+  m->mem[pos++] = 0574060565373;
+  m->mem[pos++] = 0371741405340;
+  m->mem[pos++] = 0534051524017;
+
+  memset(m->icache, 0, MEM_SIZE * sizeof(decoded));
+  m->code_gen++;
+}
+
+enum minsk_status minsk_load(struct minsk_machine *m, FILE *in)
+{
+  if (m->status)
+    return m->status;
+  return parse_in(m, in, NULL);
+}
+
+enum minsk_status minsk_load_image(struct minsk_machine *m, int fd)
+{
+  if (m->status)
+    return m->status;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size)
+    return read_image(m, fd);
+  void *img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (img == MAP_FAILED)
+    return read_image(m, fd);
+  enum minsk_status status = load_image(m, img, st.st_size);
+  munmap(img, st.st_size);
+  return status;
+}
+
+enum minsk_status minsk_convert(struct minsk_machine *m, FILE *in, FILE *out)
+{
+  if (m->status)
+    return m->status;
+  return convert(m, in, out);
+}
+
+enum minsk_status minsk_run(struct minsk_machine *m)
+{
+  if (m->status)
+    return m->status;
+  int sampling = m->sampler && sample_start(m);
+  if (m->prof)
+    {
+      struct timespec start, end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      m->prof->last_ip = -1;
+      run(m);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      m->prof->seconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    }
+  else
+    run(m);
+  if (sampling)
+    sample_stop(m);
+  flush_printer(m);
+  if (m->btrace)
+    btrace_flush(m);
+  return m->status;
+}
+
+enum minsk_status minsk_step(struct minsk_machine *m)
+{
+  if (m->status)
+    return m->status;
+  if (run_step(m))
+    {
+      flush_printer(m);
+      if (m->btrace)
+	btrace_flush(m);
+    }
+  return m->status;
+}
+
+enum minsk_status minsk_status(struct minsk_machine *m)
+{
+  return m->status;
+}
+
+void minsk_get_regs(struct minsk_machine *m, struct minsk_regs *regs)
+{
+  regs->acc = m->acc;
+  regs->r1 = m->r1;
+  regs->r2 = m->r2;
+  regs->ip = m->ip;
+  regs->prev_ip = m->prev_ip;
+}
+
+void minsk_get_usage(struct minsk_machine *m, struct minsk_usage *usage)
+{
+  usage->instructions = (m->cpu_limit > 0) ? m->cpu_limit - m->cpu_quota : 0;
+  usage->lines = (m->print_limit > 0) ? m->print_limit - m->print_quota : 0;
+}
+
+minsk_word minsk_read(struct minsk_machine *m, int block, int address)
+{
+  assert(block >= 0 && block < m->memblocks && address >= 0 && address < MEM_SIZE);
+  return m->mem[block * MEM_SIZE + address];
+}
+
+void minsk_write(struct minsk_machine *m, int block, int address, minsk_word val)
+{
+  assert(block >= 0 && block < m->memblocks && address >= 0 && address < MEM_SIZE);
+  loc a = { block, address };
+  mem_wr(m, a, val & WORD_MASK, 0, 1);
+}
+
+void minsk_translate(struct minsk_machine *m, FILE *out)
+{
+  translate(m, out);
+}
+
+int minsk_set_translation(struct minsk_machine *m, const struct minsk_translation *t)
+{
+  free(m->aot);
+  m->aot = NULL;
+  if (!t)
+    return 1;
+  if (!(m->aot = calloc(1, sizeof(struct aot))))
+    return 0;
+  m->aot->t = t;
+
+  // Translated code must report changes of all decoded cells
+  for (int i=0; i<MEM_SIZE; i++)
+    if (t->flags[i] & MINSK_NATIVE_CODE)
+      {
+	if (!m->icache[i].valid)
+	  decode(m, i);
+	if (m->mem[i] != t->image[i] || (t->flags[i] & MINSK_NATIVE_LINK))
+	  aot_changed(m, i, m->mem[i]);
+      }
+    else if (m->icache[i].valid)
+      m->aot->watch[i] = 1;
+  return 1;
+}
+
+minsk_word minsk_arith(int op, minsk_word a, minsk_word b)
+{
+  long long aa, bb, cc;
+  int i;
+
+  a &= WORD_MASK;
+  b &= WORD_MASK;
+  switch (op < 0100 ? op & ~3 : op)
+    {
+    case 004:
+      return a ^ b;
+    case 010:
+      cc = wtoll(a) + wtoll(b);
+      break;
+    case 014:
+      return fp_addsub(a, b, 0);
+    case 020:
+      cc = wtoll(a) - wtoll(b);
+      break;
+    case 024:
+    case 054:
+      return fp_addsub(a, b, 1);
+    case 030:
+      return fix_mul(a, b);
+    case 034:
+      return fp_mul(a, b);
+    case 040:
+      return fix_div(a, b);
+    case 044:
+      return fp_div(a, b);
+    case 050:
+      cc = wabs(a) - wabs(b);
+      break;
+    case 060:
+      i = wexp(b);
+      if (i <= -37 || i >= 37)
+	return 0;
+      else if (i >= 0)
+	return (a << i) & WORD_MASK;
+      else
+	return a >> (-i);
+    case 064:
+      i = wexp(b);
+      aa = wabs(a);
+      if (i <= -36 || i >= 36)
+	cc = 0;
+      else if (i >= 0)
+	cc = (aa << i) & VAL_MASK;
+      else
+	cc = aa >> (-i);
+      return (a & SIGN_MASK) | wfromll(cc);
+    case 070:
+      return a & b;
+    case 074:
+      return a | b;
+    case 0170:
+      return fix_mul_low(a, b);
+    case 0171:
+      aa = wabs(a);
+      bb = wabs(b);
+      if (!bb)
+	return OVERFLOW_WORD;
+      cc = aa % bb;
+      if (wsign(b) < 0)
+	cc = -cc;
+      return wfromll(cc);
+    default:
+      assert(0);
+    }
+  return int_in_range(cc) ? wfromll(cc) : OVERFLOW_WORD;
+}
+
+const char *minsk_message(struct minsk_machine *m, int english)
+{
+  if (m->status == MINSK_PARSE_ERROR)
+    return m->parse_msg[!!english];
+  return stop_reasons[m->status][!!english];
+}
+
+static void decode_loc(FILE *out, struct minsk_trace_record *r)
+{
+  fprintf(out, "%d:%04o %d:%04o\n", r->a_block, le16toh(r->a_address), r->b_block, le16toh(r->b_address));
+}
+
+int minsk_decode_trace(FILE *in, FILE *out, int level)
+{
+  char magic[8];
+  uint32_t hdr[2];
+  if (fread(magic, 8, 1, in) != 1 || memcmp(magic, MINSK_TRACE_MAGIC, 8) ||
+      fread(hdr, sizeof(hdr), 1, in) != 1 ||
+      le32toh(hdr[0]) != MINSK_TRACE_VERSION || le32toh(hdr[1]) != sizeof(struct minsk_trace_record))
+    return -1;
+
+  struct minsk_trace_record r;
+  word regs[3] = { 0, 0, 0 };
+  while (fread(&r, sizeof(r), 1, in) == 1)
+    {
+      word val = le64toh(r.val);
+      loc a = { r.a_block, le16toh(r.a_address) };
+      switch (r.type)
+	{
+	case MINSK_TR_INS:
+	  if (level > 0)
+	    {
+	      fprintf(out, "@%04o  %c%02o %02o ",
+		(int)(val >> 48) & 07777,
+		(val & SIGN_MASK) ? '-' : '+',
+		(int)((val >> 30) & 077),
+		(int)((val >> 24) & 077));
+	      decode_loc(out, &r);
+	    }
+	  break;
+	case MINSK_TR_INDEX:
+	  if (level > 2)
+	    {
+	      fprintf(out, "\tIndexing -> ");
+	      decode_loc(out, &r);
+	    }
+	  break;
+	case MINSK_TR_RD:
+	case MINSK_TR_WR:
+	  if (level > 2)
+	    fprintf(out, "\t%s %d:%04o = %c%012llo\n", (r.type == MINSK_TR_RD) ? "RD" : "WR", LF(a), WF(val));
+	  break;
+	case MINSK_TR_REG:
+	  if (r.reg > 2)
+	    return -1;
+	  regs[r.reg] = val;
+	  break;
+	case MINSK_TR_END:
+	  if (level > 1)
+	    fprintf(out, "\tACC:%c%012llo R1:%c%012llo R2:%c%012llo\n", WF(regs[0]), WF(regs[1]), WF(regs[2]));
+	  break;
+	default:
+	  return -1;
+	}
+    }
+  return ferror(in) ? -1 : 0;
+}
+
+void minsk_dump_recorder(struct minsk_machine *m, FILE *f, int english)
+{
+  unsigned long long n = m->rec_pos;
+  if (!m->rec || !n)
+    return;
+
+  fprintf(f, english ? "Last instructions executed:\n" : "Последние выполненные команды:\n");
+  for (unsigned long long i = (n > m->rec_mask) ? n - m->rec_mask - 1 : 0; i < n; i++)
+    {
+      record *r = &m->rec[i & m->rec_mask];
+      if (r->jit)
+	fprintf(f, english ? "@%04o  (translated block)\n" : "@%04o  (оттранслированный блок)\n", r->ip);
+      else
+	fprintf(f, "@%04o  %c%02o %02o %d:%04o %d:%04o  ACC:%c%012llo R1:%c%012llo\n",
+	  r->ip,
+	  (r->w & SIGN_MASK) ? '-' : '+',
+	  (int)((r->w >> 30) & 077),
+	  (int)((r->w >> 24) & 077),
+	  r->xb, r->x,
+	  r->yb, r->y,
+	  WF(r->acc), WF(r->r1));
+    }
+}
+
+struct profile_item
+{
+  unsigned long long count;		// What the items are sorted by
+  unsigned long long aux;
+  int from, to;
+};
+
+static int profile_item_cmp(const void *a, const void *b)
+{
+  const struct profile_item *x = a, *y = b;
+  return (x->count < y->count) ? 1 : (x->count > y->count) ? -1 : (x->from - y->from);
+}
+
+static void profile_ins(struct minsk_machine *m, FILE *f, int addr)
+{
+  word w = m->mem[addr];
+  fprintf(f, "@%04o  %c%02o %02o %04o %04o",
+    addr,
+    (w & SIGN_MASK) ? '-' : '+',
+    (int)((w >> 30) & 077),
+    (int)((w >> 24) & 077),
+    (int)((w >> 12) & 07777),
+    (int)(w & 07777));
+}
+
+#define PROFILE_TOP 20
+
+void minsk_profile_report(struct minsk_machine *m, FILE *f)
+{
+  struct profile *p = m->prof;
+  struct profile_item *items = p ? malloc(3*MEM_SIZE * sizeof(*items)) : NULL;	// Up to 3 jumps per address
+  if (!items)
+    return;
+
+  unsigned long long total = 0;
+  for (int i=0; i<MEM_SIZE; i++)
+    total += p->ins[i];
+  double pct = total ? 100. / total : 0;
+  fprintf(f, "Profile: %llu instructions in %.3f s", total, p->seconds);
+  if (p->seconds > 0)
+    fprintf(f, " (%.2f M instructions/s)", total / p->seconds / 1e6);
+  fprintf(f, "\n");
+
+  int n = 0;
+  for (int i=0; i<MEM_SIZE; i++)
+    if (p->ins[i])
+      items[n++] = (struct profile_item) { .count = p->ins[i], .from = i };
+  qsort(items, n, sizeof(items[0]), profile_item_cmp);
+  fprintf(f, "\nHot instructions:\n");
+  for (int i=0; i<n && i<PROFILE_TOP; i++)
+    {
+      fprintf(f, "  ");
+      profile_ins(m, f, items[i].from);
+      fprintf(f, "  %12llu  %5.1f%%\n", items[i].count, items[i].count * pct);
+    }
+
+  // Loops are closed by a loop instruction or a backward jump; rank them by the instructions executed inside
+  n = 0;
+  for (int i=0; i<MEM_SIZE; i++)
+    {
+      int op = (m->mem[i] >> 30) & 0177;
+      struct profile_edge *e = &p->edges[i];
+      if (op == 0120 || (op >= 0130 && op <= 0135))
+	for (int j=0; j<2; j++)
+	  if (e->count[j] && e->to[j] <= i)
+	    {
+	      unsigned long long body = 0;
+	      for (int a=e->to[j]; a<=i; a++)
+		body += p->ins[a];
+	      items[n++] = (struct profile_item) { .count = body, .aux = e->count[j], .from = e->to[j], .to = i };
+	    }
+    }
+  qsort(items, n, sizeof(items[0]), profile_item_cmp);
+  fprintf(f, "\nHot loops:\n");
+  for (int i=0; i<n && i<PROFILE_TOP; i++)
+    fprintf(f, "  @%04o-%04o  %12llu iterations  %12llu instructions  %5.1f%%\n",
+      items[i].from, items[i].to, items[i].aux, items[i].count, items[i].count * pct);
+
+  n = 0;
+  for (int i=0; i<MEM_SIZE; i++)
+    {
+      struct profile_edge *e = &p->edges[i];
+      for (int j=0; j<2; j++)
+	if (e->count[j])
+	  items[n++] = (struct profile_item) { .count = e->count[j], .from = i, .to = e->to[j] };
+      if (e->other)
+	items[n++] = (struct profile_item) { .count = e->other, .from = i, .to = -1 };
+    }
+  qsort(items, n, sizeof(items[0]), profile_item_cmp);
+  fprintf(f, "\nJumps:\n");
+  for (int i=0; i<n && i<PROFILE_TOP; i++)
+    if (items[i].to >= 0)
+      fprintf(f, "  @%04o -> @%04o  %12llu\n", items[i].from, items[i].to, items[i].count);
+    else
+      fprintf(f, "  @%04o -> other  %12llu\n", items[i].from, items[i].count);
+
+  // Arithmetic instructions are grouped with their addressing variants
+  n = 0;
+  for (int op=0; op<=0200; op++)
+    {
+      int group = (op < 0100) ? (op & ~3) : op;
+      if (!p->ops[op])
+	continue;
+      if (n && items[n-1].from == group)
+	items[n-1].count += p->ops[op];
+      else
+	items[n++] = (struct profile_item) { .count = p->ops[op], .from = group, .to = op };
+    }
+  qsort(items, n, sizeof(items[0]), profile_item_cmp);
+  fprintf(f, "\nOpcodes:\n");
+  for (int i=0; i<n; i++)
+    {
+      int op = items[i].from;
+      if (op == 0200)
+	fprintf(f, "  invalid");
+      else if (op < 0100)
+	fprintf(f, "  +%02o-%02o", op, op+3);
+      else
+	fprintf(f, "  -%02o   ", op & 077);
+      fprintf(f, "  %12llu  %5.1f%%\n", items[i].count, items[i].count * pct);
+    }
+  free(items);
+}
+
+void minsk_sample_report(struct minsk_machine *m, FILE *f, int folded)
+{
+  struct sampler *sm = m->sampler;
+  if (!sm)
+    return;
+
+  // Folded stacks, one line per host state and address, as flame graph tools like them
+  if (folded)
+    {
+      for (int h=0; h<HOST_MAX; h++)
+	for (int i=0; i<MEM_SIZE; i++)
+	  if (sm->samples[h][i])
+	    fprintf(f, "%s;@%04o %u\n", host_names[h], i, sm->samples[h][i]);
+      return;
+    }
+
+  struct profile_item *items = malloc(MEM_SIZE * sizeof(*items));
+  if (!items)
+    return;
+  unsigned long long total = 0, hosts[HOST_MAX] = { 0 };
+  int n = 0;
+  for (int i=0; i<MEM_SIZE; i++)
+    {
+      unsigned long long count = 0;
+      for (int h=0; h<HOST_MAX; h++)
+	{
+	  count += sm->samples[h][i];
+	  hosts[h] += sm->samples[h][i];
+	}
+      if (count)
+	items[n++] = (struct profile_item) { .count = count, .from = i };
+      total += count;
+    }
+  double pct = total ? 100. / total : 0;
+  fprintf(f, "Samples: %llu at %d Hz (%.3f s of CPU time)\n", total, sm->hz, (double) total / sm->hz);
+
+  qsort(items, n, sizeof(items[0]), profile_item_cmp);
+  fprintf(f, "\nHot instructions:\n");
+  for (int i=0; i<n && i<PROFILE_TOP; i++)
+    {
+      fprintf(f, "  ");
+      profile_ins(m, f, items[i].from);
+      fprintf(f, "  %8llu  %5.1f%%\n", items[i].count, items[i].count * pct);
+    }
+
+  fprintf(f, "\nEmulator:\n");
+  for (int h=0; h<HOST_MAX; h++)
+    if (hosts[h])
+      fprintf(f, "  %-12s  %8llu  %5.1f%%\n", host_names[h], hosts[h], hosts[h] * pct);
+  free(items);
+}
+
+void minsk_report(struct minsk_machine *m, FILE *f, int english)
+{
+  const char *msg = minsk_message(m, english);
+
+  if (m->status == MINSK_PARSE_ERROR)
+    {
+      if (english)
+	fprintf(f, "Parse error (line %d): %s\n", m->lino, msg);
+      else
+	fprintf(f, "Ошибка входа (стр. %d): %s\n", m->lino, msg);
+    }
+  else if (english)
+    {
+      fprintf(f, "System stopped -- %s\n", msg);
+      fprintf(f, "IP:%04o ACC:%c%012llo R1:%c%012llo R2:%c%012llo\n", m->prev_ip, WF(m->acc), WF(m->r1), WF(m->r2));
+    }
+  else
+    {
+      fprintf(f, "Машина остановлена -- %s\n", msg);
+      fprintf(f, "СчАК:%04o См:%c%012llo Р1:%c%012llo Р2:%c%012llo\n", m->prev_ip, WF(m->acc), WF(m->r1), WF(m->r2));
+    }
+}
@@ -0,0 +1,55 @@
+/*
+ *	Minsk-2 Emulator -- Binary Trace Decoder
+ *
+ *	(c) 2010 Martin Mares <mj@ucw.cz>
+ */
+
+/*
+ *  Renders a trace recorded by "minsk --trace-file" as the text the emulator
+ *  would have printed with --trace (without the printer output).
+ */
+
+#include "minsk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+static const struct option longopts[] = {
+  { "trace",		required_argument, 	NULL, 't' },
+  { NULL,		0, 			NULL, 0   },
+};
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: minsk-trace [<options>] < <trace>\n\n\
+Options:\n\n\
+-t, --trace=<level>	Trace level to render (default: 3)\n\
+");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  int level = 3;
+
+  while ((opt = getopt_long(argc, argv, "t:", longopts, NULL)) >= 0)
+    switch (opt)
+      {
+      case 't':
+	level = atoi(optarg);
+	break;
+      default:
+	usage();
+      }
+  if (optind < argc)
+    usage();
+
+  if (minsk_decode_trace(stdin, stdout, level) < 0)
+    {
+      fprintf(stderr, "minsk-trace: Invalid trace\n");
+      return 1;
+    }
+  return 0;
+}
@@ -4,827 +4,82 @@
  *	(c) 2010 Martin Mares <mj@ucw.cz>
  */
 
-/*
- * Things that are not implemented:
- *
- *	- rounding modes
- *	- exact behavior of accumulator/R1/R2 (the manual lacks details)
- *	- exact behavior of negative zero
- *	- I/O instructions for devices that are not emulated (paper tape
- *	  reader and puncher, card reader and puncher, magnetic tape unit)
- */
-
 #define _GNU_SOURCE
 #define UNUSED __attribute__((unused))
 #define NORETURN __attribute__((noreturn))
 
 #undef ENABLE_DAEMON_MODE
 
+#include "minsk.h"
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
-#include <inttypes.h>
-#include <assert.h>
-#include <math.h>
 #include <getopt.h>
 
+static int english;
+static int set_password;
+static int memblocks = 1;
 static int trace;
+static char *trace_file;
 static int cpu_quota = -1;
 static int print_quota = -1;
-static int english;
-static int memblocks = 1;
-static void (*error_hook)(char *msg);
-
-// Minsk-2 has 37-bit words in sign-magnitude representation (bit 36 = sign)
-typedef unsigned long long int word;
-
-#define  MEM_SIZE 4096
-#define WORD_MASK 01777777777777ULL
-#define SIGN_MASK 01000000000000ULL
-#define  VAL_MASK 00777777777777ULL
-
-typedef struct loc
-{
-  int block;
-  int address;
-} loc;
-
-static int wsign(word w)
-{
-  return (w & SIGN_MASK) ? -1 : 1;
-}
-
-static word wabs(word w)
-{
-  return w & VAL_MASK;
-}
-
-#define WF(w) (wsign(w) < 0 ? '-' : '+'), wabs(w)
-#define LF(a) (a.block), (a.address)
-
-static long long wtoll(word w)
-{
-  if (wsign(w) < 0)
-    return -wabs(w);
-  else
-    return wabs(w);
-}
-
-static word wfromll(long long x)
-{
-  word w = ((x < 0) ? -x : x) & VAL_MASK;
-  if (x < 0)
-    w |= SIGN_MASK;
-  return w;
-}
-
-static double wtofrac(word w)
-{
-  return (double)wtoll(w) / (double)(1ULL << 36);
-}
-
-static word wfromfrac(double d)
-{
-  return wfromll((long long)(d * (double)(1ULL << 36)));
-}
-
-static int int_in_range(long long x)
-{
-  return (x >= -(long long)VAL_MASK && x <= (long long)VAL_MASK);
-}
-
-static int frac_in_range(double d)
-{
-  return (d > -1. && d < 1.);
-}
-
-static int wexp(word w)
-{
-  int exp = w & 077;
-  return (w & 0100 ? -exp : exp);
-}
-
-static word wputexp(word w, int exp)
-{
-  return ((w & ~(word)0177) | ((exp < 0) ? 0100 | (-exp) : exp));
-}
-
-static int wmanti(word w)
-{
-  return ((w >> 8) & ((1 << 28) - 1));
-}
-
-static double wtofloat(word w)
-{
-  double x = wmanti(w);
-  return ldexp(x, wexp(w) - 28);
-}
-
-static int float_in_range(double x)
-{
-  x = fabs(x);
-  return (x <= ldexp((1 << 28) - 1, 63 - 28));
-}
-
-static word wfromfloat(double x, int normalized)
-{
-  word w = 0;
-  if (x < 0)
-    {
-      w |= SIGN_MASK;
-      x = -x;
-    }
-  int exp;
-  double m = frexp(x, &exp);
-  word mm = (word) ldexp(m, 28);
-  if (exp > 63)
-    assert(0);
-  else if (exp < -63)
-    {
-      if (normalized || exp < -91)
-	mm=0, exp=0;
-      else
-	{
-	  mm >>= -exp - 63;
-	  exp = -63;
-	}
-    }
-  w |= mm << 8;
-  if (exp < 0)
-    {
-      w |= 0100;
-      exp = -exp;
-    }
-  w |= exp;
-  return w;
-}
-
-static word **mem;
-
-static word rd(loc addr)
-{
-  word val = addr.address ? mem[addr.block][addr.address] : 0;
-  if (trace > 2)
-    printf("\tRD %d:%04o = %c%012llo\n", LF(addr), WF(val));
-  return val;
-}
-
-static void wr(loc addr, word val)
-{
-  assert(!(val & ~(WORD_MASK)));
-  if (trace > 2)
-    printf("\tWR %d:%04o = %c%012llo\n", LF(addr), WF(val));
-  mem[addr.block][addr.address] = val;
-}
-
-static int lino;
-
-NORETURN static void parse_error(char *russian_msg, char *english_msg)
-{
-  if (error_hook)
-    error_hook("Parse error");
-
-  if (english)
-    printf("Parse error (line %d): %s\n", lino, english_msg);
-  else
-    printf("Ошибка входа (стр. %d): %s\n", lino, russian_msg);
-  exit(0);
-}
-
-static void parse_in(void)
-{
-  char line[80];
-  loc addr = { 0, 0 };
-
-  while (fgets(line, sizeof(line), stdin))
-    {
-      lino++;
-      char *eol = strchr(line, '\n');
-      if (!eol)
-	parse_error("Строка слишком долгая", "Line too long");
-      *eol = 0;
-      if (eol > line && eol[-1] == '\r')
-	*--eol = 0;
-
-      char *c = line;
-      if (!c[0] || c[0] == ';')
-	continue;
-
-      if (c[0] == '.')
-	return;
-
-      if (c[0] == '@')
-	{
-	  c++;
-	  addr.address = 0;
-	  for (int i=0; i<4; i++)
-	    {
-	      while (*c == ' ')
-		c++;
-	      if (*c >= '0' && *c <= '7')
-		addr.address = 8*addr.address + *c++ - '0';
-	      else
-		parse_error("Плохая цифра", "Invalid number");
-	    }
-	  while (*c == ' ')
-	    c++;
-	  if (*c)
-	    parse_error("Адрес слишком долгий", "Address too long");
-	  continue;
-	}
+static int flush_lines = -1;
+static int recorder = -1;
+static int no_loop_check;
+static int profile;
+static int sample_hz;
+static char *folded_file;
+static int image;
 
-      word w = 0;
-      if (*c == '-')
-	w = 1;
-      else if (*c != '+')
-	parse_error("Плохой знак", "Invalid sign");
-      c++;
-      for (int i=0; i<12; i++)
-	{
-	  while (*c == ' ')
-	    c++;
-	  if (*c >= '0' && *c <= '7')
-	    w = 8*w + *c++ - '0';
-	  else
-	    parse_error("Плохая цифра", "Invalid number");
-	}
-      while (*c == ' ')
-	c++;
-      if (*c)
-	parse_error("Номер слишком долгий", "Number too long");
-      wr(addr, w);
-      addr.address = (addr.address+1) & 07777;
-    }
-}
-
-static word acc;
-static word r1, r2, current_ins;
-static int ip = 00050;			// Standard program start location
-static int prev_ip;
-
-NORETURN static void stop(char *russian_reason, char *english_reason)
-{
-  if (error_hook)
-    error_hook(english_reason);
-
-  if (english)
-    {
-      printf("System stopped -- %s\n", english_reason);
-      printf("IP:%04o ACC:%c%012llo R1:%c%012llo R2:%c%012llo\n", prev_ip, WF(acc), WF(r1), WF(r2));
-    }
-  else
-    {
-      printf("Машина остановлена -- %s\n", russian_reason);
-      printf("СчАК:%04o См:%c%012llo Р1:%c%012llo Р2:%c%012llo\n", prev_ip, WF(acc), WF(r1), WF(r2));
-    }
-  exit(0);
-}
-
-NORETURN static void over(void)
-{
-  stop("Аварийный останов", "Overflow");
-}
-
-NORETURN static void notimp(void)
-{
-  acc = current_ins;
-  stop("Устройство разбитое", "Not implemented");
-}
-
-NORETURN static void noins(void)
+NORETURN static void die(char *msg)
 {
-  acc = current_ins;
-  stop("Эту команду не знаю", "Illegal instruction");
+  fprintf(stderr, "minsk: %s\n", msg);
+  exit(1);
 }
 
-static uint16_t linebuf[128];
-
-static uint16_t russian_chars[64] = {
-	'0',	'1',	'2',	'3',	'4',	'5',	'6',	'7',	// 0x
-	'8',	'9',	'+',	'-',	'/',	',',	'.',	' ',	// 1x
-	0x2169,	'^',	'(',	')',	0x00d7,	'=',	';',	'[',	// 2x
-	']',	'*',	'`',	'\'',	0x2260,	'<',	'>',	':',	// 3x
-	0x410,	0x411,	0x412,	0x413,	0x414,	0x415,	0x416,	0x417,	// 4x
-	0x418,	0x419,	0x41a,	0x41b,	0x41c,	0x41d,	0x41e,	0x41f,	// 5x
-	0x420,	0x421,	0x422,	0x423,	0x424,	0x425,	0x426,	0x427,	// 6x
-	0x428,	0x429,	0x42b,	0x42c,	0x42d,	0x42e,	0x42f,	0x2013	// 7x
-};
-
-static uint16_t latin_chars[64] = {
-	'0',	'1',	'2',	'3',	'4',	'5',	'6',	'7',	// 0x
-	'8',	'9',	'+',	'-',	'/',	',',	'.',	' ',	// 1x
-	0x2169,	'^',	'(',	')',	0x00d7,	'=',	';',	'[',	// 2x
-	']',	'*',	'`',	'\'',	0x2260,	'<',	'>',	':',	// 3x
-	'A',	'B',	'W',	'G',	'D',	'E',	'V',	'Z',	// 4x
-	'I',	'J',	'K',	'L',	'M',	'N',	'O',	'P',	// 5x
-	'R',	'S',	'T',	'U',	'F',	'H',	'C',	' ',	// 6x
-	' ',	' ',	'Y',	'X',	' ',	' ',	'Q',	0x2013	// 7x
-};
-
-static void print_line(int r)
+static struct minsk_machine *new_machine(void)
 {
-  /*
-   *  Meaning of bits of r:
-   *	0 = perform line feed
-   *	1 = clear buffer
-   *	2 = actually print
-   */
-  if (r & 4)
-    {
-      if (print_quota > 0 && !--print_quota)
-	stop("Бумага дошла - нужно ехать в Сибирь про новую", "Out of paper");
-      for (int i=0; i<128; i++)
-	{
-	  int ch = linebuf[i];
-	  if (!ch)
-	    ch = ' ';
-	  if (ch < 0x80)
-	    putchar(ch);
-	  else if (ch < 0x800)
-	    {
-	      putchar(0xc0 | (ch >> 6));
-	      putchar(0x80 | (ch & 0x3f));
-	    }
-	  else
-	    {
-	      putchar(0xe0 | (ch >> 12));
-	      putchar(0x80 | ((ch >> 6) & 0x3f));
-	      putchar(0x80 | (ch & 0x3f));
-	    }
-	}
-    }
-  if (r & 2)
-    memset(linebuf, 0, sizeof(linebuf));
-  if (r & 1)
-    putchar('\n');
-  else if (r & 4)
-    putchar('\r');
-  fflush(stdout);
+  struct minsk_machine *m = minsk_new(memblocks);
+  if (!m)
+    die("Out of memory");
+  minsk_set_trace(m, trace);
+  minsk_set_cpu_quota(m, cpu_quota);
+  minsk_set_print_quota(m, print_quota);
+  if (flush_lines >= 0)
+    minsk_set_flush(m, flush_lines);
+  if (no_loop_check)
+    minsk_set_loop_check(m, 0);
+  if (recorder >= 0 && !minsk_set_recorder(m, recorder))
+    die("Out of memory");
+  if (profile && !minsk_set_profile(m, 1))
+    die("Out of memory");
+  if (sample_hz > 0 && !minsk_set_sampling(m, sample_hz))
+    die("Cannot set up sampling");
+  return m;
 }
 
-static void print_ins(int x, loc y)
+// After a crash, list the last instructions from the flight recorder
+static void post_mortem(struct minsk_machine *m, FILE *f)
 {
-  word yy = rd(y);
-  int pos = x & 0177;
-  int r = (x >> 9) & 7;
-
-  if (x & 0400)
+  switch (minsk_status(m))
     {
-      print_line(r);
-      return;
-    }
-
-  char *fmt;
-  int bit = 37;
-  int eat = 0;
-  switch (r)
-    {
-    case 0:				// Decimal float
-      fmt = "+dddddddx+xbd";
-      break;
-    case 1:				// Octal number
-      fmt = "+oooooooooooo";
+    case MINSK_OVERFLOW:
+    case MINSK_NOT_IMPLEMENTED:
+    case MINSK_ILLEGAL:
+      minsk_dump_recorder(m, f, english);
       break;
-    case 2:				// Decimal fixed
-      fmt = "+ddddddddd";
-      break;
-    case 3:				// Decimal unsigned
-      fmt = "x ddddddddd";
-      eat = 1;
-      break;
-    case 4:				// One Russian symbol
-      fmt = "xr";
-      break;
-    case 5:				// Russian text
-      fmt = "xrrrrrr";
-      break;
-    case 6:				// One Latin symbol
-      fmt = "xl";
-      break;
-    default:				// Latin text
-      fmt = "xllllll";
-    }
-
-  while (*fmt)
-    {
-      int ch;
-      switch (*fmt++)
-	{
-	case 'x':
-	  bit--;
-	  continue;
-	case ' ':
-	  ch = ' ';
-	  break;
-	case '+':
-	  bit--;
-	  ch = (yy & (1ULL << bit)) ? '-' : '+';
-	  break;
-	case 'b':
-	  bit--;
-	  ch = '0' + ((yy >> bit) & 1);
-	  break;
-	case 'o':
-	  bit -= 3;
-	  ch = '0' + ((yy >> bit) & 7);
-	  break;
-	case 'd':
-	  bit -= 4;
-	  ch = '0' + ((yy >> bit) & 15);
-	  if (ch > '0' + 9)
-	    ch += 7;
-	  break;
-	case 'r':
-	  bit -= 6;
-	  ch = russian_chars[(yy >> bit) & 077];
-	  break;
-	case 'l':
-	  bit -= 6;
-	  ch = latin_chars[(yy >> bit) & 077];
-	  break;
-	default:
-	  assert(0);
-	}
-
-      if (eat && *fmt)
-	{
-	  if (ch == '0' || ch == ' ')
-	    ch = ' ';
-	  else
-	    eat = 0;
-	}
-      linebuf[pos] = ch;
-      pos = (pos+1) & 0177;
-    }
-  assert(bit >= 0);
-}
-
-static void run(void)
-{
-  for (;;)
-    {
-      r2 = acc;
-      prev_ip = ip;
-      word w = mem[0][ip];
-      current_ins = w;
-
-      int op = (w >> 30) & 0177;	// Operation code
-      int ax = (w >> 28) & 3;		// Address extensions supported in Minsk-22 mode
-      int ix = (w >> 24) & 15;		// Indexing
-      loc x = { ax >> 1, (w >> 12) & 07777 };	// Operands (original form)
-      loc y = { ax & 1, w & 07777 };
-      loc xi=x, yi=y;			// (indexed form)
-      if (trace)
-	printf("@%04o  %c%02o %02o %d:%04o %d:%04o\n",
-	  ip,
-	  (w & SIGN_MASK) ? '-' : '+',
-	  (int)((w >> 30) & 077),
-	  (int)((w >> 24) & 077),
-	  LF(x),
-	  LF(y));
-      if (ix)
-	{
-	  if (op != 0120)
-	    {
-	      loc iaddr = { 0, ix };
-	      word i = rd(iaddr);
-	      xi.address = (xi.address + (int)((i >> 12) & 07777)) & 07777;
-	      yi.address = (yi.address + (int)(i & 07777)) & 07777;
-	      if (trace > 2)
-		printf("\tIndexing -> %d:%04o %d:%04o\n", LF(xi), LF(yi));
-	    }
-	}
-      ip = (ip+1) & 07777;
-
-      if (cpu_quota > 0 && !--cpu_quota)
-	stop("Тайм-аут", "CPU quota exceeded");
-
-      /* Arithmetic operations */
-
-      word a, b, c;
-      long long aa, bb, cc;
-      double ad, bd;
-      int i;
-
-      auto void afetch(void);
-      void afetch(void)
-	{
-	  if (op & 2)
-	    a = r2;
-	  else
-	    a = rd(yi);
-	  b = r1 = rd(xi);
-	}
-
-      auto void astore(word result);
-      void astore(word result)
-	{
-	  acc = result;
-	  if (op & 1)
-	    wr(yi, acc);
-	}
-
-      auto void astore_int(long long x);
-      void astore_int(long long x)
-	{
-	  if (!int_in_range(x))
-	    over();
-	  astore(wfromll(x));
-	}
-
-      auto void astore_frac(double f);
-      void astore_frac(double f)
-	{
-	  if (!frac_in_range(f))
-	    over();
-	  astore(wfromfrac(f));
-	}
-
-      auto void astore_float(double f);
-      void astore_float(double f)
-	{
-	  if (!float_in_range(f))
-	    over();
-	  astore(wfromfloat(f, 0));
-	}
-
-      if (ax && memblocks == 1)	// Reject address extensions if we only have 1 memory block
-	op = -1;
-      switch (op)
-	{
-	case 000:		// NOP
-	  break;
-	case 004 ... 007:	// XOR
-	  afetch();
-	  astore(a^b);
-	  break;
-	case 010 ... 013:	// FIX addition
-	  afetch();
-	  astore_int(wtoll(a) + wtoll(b));
-	  break;
-	case 014 ... 017:	// FP addition
-	  afetch();
-	  astore_float(wtofloat(a) + wtofloat(b));
-	  break;
-	case 020 ... 023:	// FIX subtraction
-	  afetch();
-	  astore_int(wtoll(a) - wtoll(b));
-	  break;
-	case 024 ... 027:	// FP subtraction
-	  afetch();
-	  astore_float(wtofloat(a) - wtofloat(b));
-	  break;
-	case 030 ... 033:	// FIX multiplication
-	  afetch();
-	  astore_frac(wtofrac(a) * wtofrac(b));
-	  break;
-	case 034 ... 037:	// FP multiplication
-	  afetch();
-	  astore_float(wtofloat(a) * wtofloat(b));
-	  break;
-	case 040 ... 043:	// FIX division
-	  afetch();
-	  ad = wtofrac(a);
-	  bd = wtofrac(b);
-	  if (!wabs(b))
-	    over();
-	  astore_frac(ad / bd);
-	  break;
-	case 044 ... 047:	// FP division
-	  afetch();
-	  ad = wtofloat(a);
-	  bd = wtofloat(b);
-	  if (!bd || wexp(b) < -63)
-	    over();
-	  astore_float(ad / bd);
-	  break;
-	case 050 ... 053:	// FIX subtraction of abs values
-	  afetch();
-	  astore_int(wabs(a) - wabs(b));
-	  break;
-	case 054 ... 057:	// FP subtraction of abs values
-	  afetch();
-	  astore_float(fabs(wtofloat(a)) - fabs(wtofloat(b)));
-	  break;
-	case 060 ... 063:	// Shift logical
-	  afetch();
-	  i = wexp(b);
-	  if (i <= -37 || i >= 37)
-	    astore(0);
-	  else if (i >= 0)
-	    astore((a << i) & WORD_MASK);
-	  else
-	    astore(a >> (-i));
-	  break;
-	case 064 ... 067:	// Shift arithmetical
-	  afetch();
-	  i = wexp(b);
-	  aa = wabs(a);
-	  if (i <= -36 || i >= 36)
-	    cc = 0;
-	  else if (i >= 0)
-	    cc = (aa << i) & VAL_MASK;
-	  else
-	    cc = aa >> (-i);
-	  astore((a & SIGN_MASK) | wfromll(cc));
-	  break;
-	case 070 ... 073:	// And
-	  afetch();
-	  astore(a&b);
-	  break;
-	case 074 ... 077:	// Or
-	  afetch();
-	  astore(a|b);
-	  break;
-
-	case 0100:		// Halt
-	  r1 = rd(x);
-	  acc = rd(y);
-	  stop("Останов машины", "Halted");
-	case 0103:		// I/O magtape
-	  notimp();
-	case 0104:		// Disable rounding
-	  notimp();
-	case 0105:		// Enable rounding
-	  notimp();
-	case 0106:		// Interrupt control
-	  notimp();
-	case 0107:		// Reverse tape
-	  notimp();
-	case 0110:		// Move
-	  wr(yi, r1 = acc = rd(xi));
-	  break;
-	case 0111:		// Move negative
-	  wr(yi, acc = (r1 = rd(xi)) ^ SIGN_MASK);
-	  break;
-	case 0112:		// Move absolute value
-	  wr(yi, acc = (r1 = rd(xi)) & VAL_MASK);
-	  break;
-	case 0113:		// Read from keyboard
-	  notimp();
-	case 0114:		// Copy sign
-	  wr(yi, acc = rd(yi) ^ ((r1 = rd(xi)) & SIGN_MASK));
-	  break;
-	case 0115:		// Read code from R1 (obscure)
-	  notimp();
-	case 0116:		// Copy exponent
-	  wr(yi, acc = wputexp(rd(yi), wexp(r1 = rd(xi))));
-	  break;
-	case 0117:		// I/O teletype
-	  notimp();
-	case 0120:		// Loop
-	  if (!ix)
-	    noins();
-	  loc iaddr = { 0, ix };
-	  a = r1 = rd(iaddr);
-	  aa = (a >> 24) & 017777;
-	  if (!aa)
-	    break;
-	  b = rd(y);		// (a mountain range near Prague)
-	  acc = ((aa-1) << 24) |
-		(((((a >> 12) & 07777) + (b >> 12) & 07777) & 07777) << 12) |
-		(((a & 07777) + (b & 07777)) & 07777);
-	  wr(iaddr, acc);
-	  ip = x.address;
-	  break;
-	case 0130:		// Jump
-	  wr(y, r2);
-	  ip = x.address;
-	  break;
-	case 0131:		// Jump to subroutine
-	  wr(y, acc = ((0130ULL << 30) | ((ip & 07777ULL) << 12)));
-	  ip = x.address;
-	  break;
-	case 0132:		// Jump if positive
-	  if (wsign(r2) >= 0)
-	    ip = x.address;
-	  else
-	    ip = y.address;
-	  break;
-	case 0133:		// Jump if overflow
-	  // Since we always trap on overflow, this instruction always jumps to the 1st address
-	  ip = x.address;
-	  break;
-	case 0134:		// Jump if zero
-	  if (!wabs(r2))
-	    ip = y.address;
-	  else
-	    ip = x.address;
-	  break;
-	case 0135:		// Jump if key pressed
-	  // No keys are ever pressed, so always jump to 2nd
-	  ip = y.address;
-	  break;
-	case 0136:		// Interrupt masking
-	  notimp();
-	case 0137:		// Used only when reading from tape
-	  notimp();
-	case 0140 ... 0147:	// I/O
-	  notimp();
-	case 0150 ... 0154:	// I/O
-	  notimp();
-	case 0160 ... 0161:	// I/O
-	  notimp();
-	case 0162:		// Printing
-	  print_ins(x.address, y);
-	  break;
-	case 0163:		// I/O
-	  notimp();
-	case 0170:		// FIX multiplication, bottom part
-	  afetch();
-	  if (wtofrac(a) * wtofrac(b) >= .1/(1ULL << 32))
-	    over();
-	  acc = wfromll(((unsigned long long)wabs(a) * (unsigned long long)wabs(b)) & VAL_MASK);
-	  // XXX: What should be the sign? The book does not define that.
-	  break;
-	case 0171:		// Modulo
-	  afetch();
-	  aa = wabs(a);
-	  bb = wabs(b);
-	  if (!bb)
-	    over();
-	  cc = aa % bb;
-	  if (wsign(b) < 0)
-	    cc = -cc;
-	  acc = wfromll(cc);
-	  break;
-	case 0172:		// Add exponents
-	  a = r1 = rd(xi);
-	  b = rd(yi);
-	  i = wexp(a) + wexp(b);
-	  if (i < -63 || i > 63)
-	    over();
-	  acc = wputexp(b, i);
-	  wr(yi, acc);
-	  break;
-	case 0173:		// Sub exponents
-	  a = r1 = rd(xi);
-	  b = rd(yi);
-	  i = wexp(b) - wexp(a);
-	  if (i < -63 || i > 63)
-	    over();
-	  acc = wputexp(b, i);
-	  wr(yi, acc);
-	  break;
-	case 0174:		// Addition in one's complement
-	  a = r1 = rd(xi);
-	  b = rd(yi);
-	  c = a + b;
-	  if (c > VAL_MASK)
-	    c = c - VAL_MASK;
-	  wr(yi, c);
-	  // XXX: The effect on the accumulator is undocumented, but likely to be as follows:
-	  acc = c;
-	  break;
-	case 0175:		// Normalization
-	  a = r1 = rd(xi);
-	  if (!wabs(a))
-	    {
-	      wr(yi, 0);
-	      loc yinc = { yi.block, (yi.address+1) & 07777 };
-	      wr(yinc, 0);
-	      acc = 0;
-	    }
-	  else
-	    {
-	      i = 0;
-	      acc = a & SIGN_MASK;
-	      a &= VAL_MASK;
-	      while (!(a & (SIGN_MASK >> 1)))
-		{
-		  a <<= 1;
-		  i++;
-		}
-	      acc |= a;
-	      wr(yi, acc);
-	      loc yinc = { yi.block, (yi.address+1) & 07777 };
-	      wr(yinc, i);
-	    }
-	  break;
-	case 0176:		// Population count
-	  a = r1 = rd(xi);
-	  cc = 0;
-	  for (int i=0; i<36; i++)
-	    if (a & (1ULL << i))
-	      cc++;
-	  // XXX: Guessing that acc gets a copy of the result
-	  acc = wfromll(cc);
-	  wr(yi, acc);
-	  break;
-	default:
-	  noins();
-	}
-
-      if (trace > 1)
-	printf("\tACC:%c%012llo R1:%c%012llo R2:%c%012llo\n", WF(acc), WF(r1), WF(r2));
+    default: ;
     }
 }
 
-NORETURN static void die(char *msg)
+static enum minsk_status load_program(struct minsk_machine *m, FILE *in)
 {
-  fprintf(stderr, "minsk: %s\n", msg);
-  exit(1);
+  if (image)
+    return minsk_load_image(m, fileno(in));
+  else
+    return minsk_load(m, in);
 }
 
 /*** Daemon interface ***/
@@ -844,8 +99,11 @@ NORETURN static void die(char *msg)
 #include <sys/wait.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 
 #if 0
 #define DTRACE(msg, args...) fprintf(stderr, msg "\n", ##args)
@@ -860,6 +118,7 @@ NORETURN static void die(char *msg)
 #define MAX_TRACKERS 200		// IP address trackers
 #define TBF_MAX 5			// Max number of tokens in the bucket
 #define TBF_REFILL_PER_SEC 0.2		// Bucket refill rate (buckets/sec)
+#define MAX_WORKERS 256			// Pre-forked workers
 
 #define PID_FILE "/var/run/pd-minsk.pid"
 #define UID 124
@@ -937,38 +196,48 @@ static void sigalrm_handler(int sig UNUSED)
   exit(0);
 }
 
-static void child_error_hook(char *err)
-{
-  DLOG("Stopped: %s", err);
-}
-
-static void child(int sk2)
+static void set_alarm_handler(void)
 {
-  dup2(sk2, 0);
-  dup2(sk2, 1);
-  close(sk2);
-
   struct sigaction sact = {
     .sa_handler = sigalrm_handler,
   };
   if (sigaction(SIGALRM, &sact, NULL) < 0)
     die("sigaction: %m");
+}
 
+// Run a program received over a connection, whose output goes to fd 1
+static void serve(struct minsk_machine *m, FILE *in)
+{
   // Set up limits
   alarm(60);
-  cpu_quota = 100000;
-  print_quota = 100;
+  minsk_reset(m);
+  if (set_password)
+    minsk_set_password(m);
+  minsk_set_cpu_quota(m, 100000);
+  minsk_set_print_quota(m, 100);
 
   const char welcome[] = "+++ Welcome to our computer museum. +++\n+++ Our time machine will connect you to one of our exhibits. +++\n\n";
   write(1, welcome, sizeof(welcome));
 
-  error_hook = child_error_hook;
-  parse_in();
-  run();
+  if (minsk_load(m, in) == MINSK_RUNNING)
+    minsk_run(m);
+  DLOG("Stopped: %s", minsk_message(m, 1));
+  minsk_report(m, stdout, english);
   fflush(stdout);
+  alarm(0);
   DTRACE("Finished");
 }
 
+static void child(struct minsk_machine *m, int sk2)
+{
+  dup2(sk2, 0);
+  dup2(sk2, 1);
+  close(sk2);
+
+  set_alarm_handler();
+  serve(m, stdin);
+}
+
 struct conn {
   pid_t pid;
   struct in_addr addr;
@@ -1015,7 +284,50 @@ struct tracker {
   double tokens;
 };
 
-static struct tracker trackers[MAX_TRACKERS];
+/*
+ *  Trackers live in memory shared by all processes of the daemon, so that
+ *  pre-forked workers enforce the limits together. Any process touching
+ *  them must hold the lock.
+ */
+
+struct shared_state {
+  pthread_mutex_t lock;
+  struct tracker trackers[MAX_TRACKERS];
+  int worker_tracker[MAX_WORKERS];	// Tracker used by the connection a worker serves, or -1
+};
+
+static struct shared_state *shared;
+static struct tracker *trackers;
+
+static void init_shared(void)
+{
+  shared = mmap(NULL, sizeof(struct shared_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED)
+    die("mmap: %m");
+  trackers = shared->trackers;
+  for (int i=0; i<MAX_WORKERS; i++)
+    shared->worker_tracker[i] = -1;
+
+  // Robust, because a worker can die while holding the lock
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  if (pthread_mutex_init(&shared->lock, &attr))
+    die("Cannot initialize shared lock");
+  pthread_mutexattr_destroy(&attr);
+}
+
+static void lock_trackers(void)
+{
+  if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&shared->lock);
+}
+
+static void unlock_trackers(void)
+{
+  pthread_mutex_unlock(&shared->lock);
+}
 
 static int get_tracker(struct conn *c)
 {
@@ -1106,7 +418,7 @@ static void put_tracker(struct conn *c)
   DTRACE("TBF: Put tracker (%d conns remain)", t->active_conns);
 }
 
-static void run_as_daemon(int do_fork)
+static int open_listener(int reuse_port)
 {
   int sk = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
   if (sk < 0)
@@ -1115,6 +427,8 @@ static void run_as_daemon(int do_fork)
   int one = 1;
   if (setsockopt(sk, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0)
     die("setsockopt: %m");
+  if (reuse_port && setsockopt(sk, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    die("setsockopt: %m");
 
   struct sockaddr_in sa = {
     .sin_family = AF_INET,
@@ -1127,6 +441,141 @@ static void run_as_daemon(int do_fork)
     die("listen: %m");
   // if (fcntl(sk, F_SETFL, O_NONBLOCK) < 0)
   //  die("fcntl: %m");
+  return sk;
+}
+
+/*
+ *  With pre-forked workers, every worker has its own listening socket
+ *  bound with SO_REUSEPORT, so the kernel spreads connections among them.
+ *  A worker serves its connections one after another. The parent process
+ *  only restarts workers that exit (e.g., after a time-out) and returns
+ *  their trackers.
+ */
+
+static void worker(struct minsk_machine *m, int w)
+{
+  int sk = open_listener(1);
+  int null = open("/dev/null", O_WRONLY);	// Parked on fd 1 between connections
+  if (null < 0)
+    die("Cannot open /dev/null: %m");
+  dup2(null, 1);
+  set_alarm_handler();
+  setproctitle("minsk: Listening");
+
+  for (;;)
+    {
+      struct sockaddr_in sa;
+      socklen_t salen = sizeof(sa);
+      int sk2 = accept(sk, (struct sockaddr *) &sa, &salen);
+      if (sk2 < 0)
+	{
+	  if (errno != EINTR)
+	    {
+	      DLOG("accept: %m");
+	      sleep(5);
+	    }
+	  continue;
+	}
+      DTRACE("Worker %d got connection: fd=%d", w, sk2);
+
+      struct conn c = { .addr = sa.sin_addr };
+      lock_trackers();
+      int ok = get_tracker(&c);
+      if (ok)
+	shared->worker_tracker[w] = c.tracker - trackers;
+      unlock_trackers();
+      if (!ok)
+	{
+	  DLOG("Connection from %s dropped: Throttling", inet_ntoa(sa.sin_addr));
+	  const char *reason = "--- Sorry, but you are sending too many requests. Please slow down. ---\n";
+	  write(sk2, reason, strlen(reason));
+	  close(sk2);
+	  continue;
+	}
+
+      DLOG("Accepted connection from %s", inet_ntoa(sa.sin_addr));
+      setproctitle("minsk: %s", inet_ntoa(sa.sin_addr));
+      dup2(sk2, 1);
+      FILE *in = fdopen(sk2, "r");
+      serve(m, in);
+
+      // Release the tracker before the client can see the connection closed
+      lock_trackers();
+      put_tracker(&c);
+      shared->worker_tracker[w] = -1;
+      unlock_trackers();
+      fclose(in);
+      dup2(null, 1);
+      setproctitle("minsk: Listening");
+    }
+}
+
+NORETURN static void run_prefork(struct minsk_machine *m, int per_cpu)
+{
+  static pid_t workers[MAX_WORKERS];
+  int nworkers = per_cpu * sysconf(_SC_NPROCESSORS_ONLN);
+  if (nworkers < 1)
+    nworkers = 1;
+  if (nworkers > MAX_WORKERS)
+    nworkers = MAX_WORKERS;
+  DLOG("Starting %d workers", nworkers);
+
+  for (;;)
+    {
+      for (int w=0; w<nworkers; w++)
+	if (!workers[w])
+	  {
+	    pid_t pid = fork();
+	    if (pid < 0)
+	      {
+		DLOG("fork failed: %m");
+		sleep(5);
+		break;
+	      }
+	    if (!pid)
+	      {
+		worker(m, w);
+		exit(0);
+	      }
+	    DTRACE("Created worker %d as process %d", w, pid);
+	    workers[w] = pid;
+	  }
+
+      int status;
+      pid_t pid = waitpid(-1, &status, 0);
+      if (pid < 0)
+	{
+	  if (errno != EINTR)
+	    sleep(1);
+	  continue;
+	}
+      if (!WIFEXITED(status) || WEXITSTATUS(status))
+	{
+	  DLOG("Process %d exited with strange status %x", pid, status);
+	  sleep(1);
+	}
+
+      for (int w=0; w<nworkers; w++)
+	if (workers[w] == pid)
+	  {
+	    workers[w] = 0;
+	    lock_trackers();
+	    if (shared->worker_tracker[w] >= 0)
+	      {
+		struct conn c = { .tracker = &trackers[shared->worker_tracker[w]] };
+		put_tracker(&c);
+		shared->worker_tracker[w] = -1;
+	      }
+	    unlock_trackers();
+	  }
+    }
+}
+
+static void run_as_daemon(struct minsk_machine *m, int do_fork, int prefork)
+{
+  int sk = -1;
+  if (!prefork)
+    sk = open_listener(0);
 
   if (do_fork)
     {
@@ -1160,6 +609,10 @@ static void run_as_daemon(int do_fork)
   DLOG("Daemon ready");
   setproctitle("minsk: Listening");
   openlog("minsk", LOG_PID, LOG_LOCAL7);
+  init_shared();
+
+  if (prefork)
+    run_prefork(m, prefork);
 
   for (;;)
     {
@@ -1186,7 +639,9 @@ static void run_as_daemon(int do_fork)
 	  if (conn)
 	    {
 	      DTRACE("Connection with PID %d exited", pid);
+	      lock_trackers();
 	      put_tracker(conn);
+	      unlock_trackers();
 	      put_conn(conn);
 	    }
 	  else
@@ -1196,6 +651,7 @@ static void run_as_daemon(int do_fork)
       if (!(pfd[0].revents & POLLIN))
 	continue;
 
+      struct sockaddr_in sa;
       socklen_t salen = sizeof(sa);
       int sk2 = accept(sk, (struct sockaddr *) &sa, &salen);
       if (sk2 < 0)
@@ -1213,7 +669,10 @@ static void run_as_daemon(int do_fork)
       const char *reason = NULL;
       if (conn)
 	{
-	  if (!get_tracker(conn))
+	  lock_trackers();
+	  int ok = get_tracker(conn);
+	  unlock_trackers();
+	  if (!ok)
 	    {
 	      DLOG("Connection from %s dropped: Throttling", inet_ntoa(sa.sin_addr));
 	      put_conn(conn);
@@ -1241,7 +700,7 @@ static void run_as_daemon(int do_fork)
 	    {
 	      DLOG("Accepted connection from %s", inet_ntoa(sa.sin_addr));
 	      setproctitle("minsk: %s", inet_ntoa(sa.sin_addr));
-	      child(sk2);
+	      child(m, sk2);
 	    }
 	  else
 	    {
@@ -1261,7 +720,7 @@ static void run_as_daemon(int do_fork)
 
 #else
 
-static void run_as_daemon(int do_fork UNUSED)
+static void run_as_daemon(struct minsk_machine *m UNUSED, int do_fork UNUSED, int prefork UNUSED)
 {
   die("Daemon mode not supported in this version, need to recompile.");
 }
@@ -1272,42 +731,198 @@ static void setproctitle_init(int argc UNUSED, char **argv UNUSED)
 
 #endif
 
-static void init_memory(int set_password)
+/*** Batch mode ***/
+
+/*
+ *  In batch mode, we run programs from many files, each on its own
+ *  machine, in a pool of worker threads. One more thread loads the
+ *  programs, so parsing of the next jobs overlaps with running the
+ *  current ones. Printer output and the stop message of each program
+ *  go to a file named after the input with ".out" appended.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+
+struct job {
+  struct job *next;
+  struct minsk_machine *m;
+  FILE *out;
+};
+
+struct job_queue {
+  struct job *head, **tail;
+  int closed;				// No more jobs will arrive
+  pthread_cond_t cond;
+};
+
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct job_queue free_jobs, ready_jobs;
+static int batch_errors;
+
+static void queue_init(struct job_queue *q)
 {
-  mem = malloc(memblocks * sizeof(word *));
-  for (int i=0; i<memblocks; i++)
-    mem[i] = malloc(MEM_SIZE * sizeof(word));
+  q->head = NULL;
+  q->tail = &q->head;
+  pthread_cond_init(&q->cond, NULL);
+}
 
-  if (set_password)
+static void queue_put(struct job_queue *q, struct job *j)
+{
+  pthread_mutex_lock(&batch_lock);
+  j->next = NULL;
+  *q->tail = j;
+  q->tail = &j->next;
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&batch_lock);
+}
+
+// Wait for a job; returns NULL if the queue is empty and closed
+static struct job *queue_get(struct job_queue *q)
+{
+  pthread_mutex_lock(&batch_lock);
+  while (!q->head && !q->closed)
+    pthread_cond_wait(&q->cond, &batch_lock);
+  struct job *j = q->head;
+  if (j && !(q->head = j->next))
+    q->tail = &q->head;
+  pthread_mutex_unlock(&batch_lock);
+  return j;
+}
+
+static void queue_close(struct job_queue *q)
+{
+  pthread_mutex_lock(&batch_lock);
+  q->closed = 1;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&batch_lock);
+}
+
+static void batch_error(const char *name, const char *msg)
+{
+  fprintf(stderr, "minsk: %s: %s\n", name, msg);
+  pthread_mutex_lock(&batch_lock);
+  batch_errors++;
+  pthread_mutex_unlock(&batch_lock);
+}
+
+static void *batch_loader(void *arg)
+{
+  char **files = arg;
+
+  for (; *files; files++)
     {
-      // For the contest, we fill the whole memory with -00 00 0000 0000 (HALT),
-      // not +00 00 0000 0000 (NOP). Otherwise, an empty program would reveal
-      // the location of the password :)
-      for (int i=0; i<memblocks; i++)
-        for (int j=0; j<MEM_SIZE; j++)
-          mem[i][j] = 01000000000000ULL;
-
-      // Store the password
-      int pos = 02655;
-      mem[0][pos++] = 0574060565373;
-      mem[0][pos++] = 0371741405340;
-      mem[0][pos++] = 0534051524017;
+      char *name = *files;
+      FILE *in = fopen(name, "r");
+      if (!in)
+	{
+	  batch_error(name, strerror(errno));
+	  continue;
+	}
+      char outname[strlen(name) + 5];
+      sprintf(outname, "%s.out", name);
+      FILE *out = fopen(outname, "w");
+      if (!out)
+	{
+	  batch_error(outname, strerror(errno));
+	  fclose(in);
+	  continue;
+	}
+
+      struct job *j = queue_get(&free_jobs);
+      j->out = out;
+      minsk_reset(j->m);
+      if (set_password)
+	minsk_set_password(j->m);
+      minsk_set_output(j->m, out);
+      load_program(j->m, in);
+      fclose(in);
+      queue_put(&ready_jobs, j);
     }
-  else
-    for (int i=0; i<memblocks; i++)
-      for (int j=0; j<MEM_SIZE; j++)
-        mem[i][j] = 00000000000000ULL;
+
+  queue_close(&ready_jobs);
+  return NULL;
+}
+
+static void *batch_worker(void *arg UNUSED)
+{
+  struct job *j;
+
+  while (j = queue_get(&ready_jobs))
+    {
+      minsk_run(j->m);
+      minsk_report(j->m, j->out, english);
+      post_mortem(j->m, j->out);
+      minsk_profile_report(j->m, j->out);
+      minsk_sample_report(j->m, j->out, 0);
+      if (fclose(j->out))
+	batch_error("Write error", strerror(errno));
+      queue_put(&free_jobs, j);
+    }
+  return NULL;
+}
+
+static int run_batch(char **files, int threads)
+{
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads <= 0)
+    threads = 1;
+
+  // Output goes to files, so unless asked otherwise, it is flushed only when the program stops
+  if (flush_lines < 0)
+    flush_lines = 0;
+
+  // Twice as many machines as workers, so that loading can run ahead
+  queue_init(&free_jobs);
+  queue_init(&ready_jobs);
+  int njobs = 2*threads;
+  struct job jobs[njobs];
+  for (int i=0; i<njobs; i++)
+    {
+      jobs[i].m = new_machine();
+      queue_put(&free_jobs, &jobs[i]);
+    }
+
+  pthread_t loader, workers[threads];
+  if (pthread_create(&loader, NULL, batch_loader, files))
+    die("Cannot create thread");
+  for (int i=0; i<threads; i++)
+    if (pthread_create(&workers[i], NULL, batch_worker, NULL))
+      die("Cannot create thread");
+
+  pthread_join(loader, NULL);
+  for (int i=0; i<threads; i++)
+    pthread_join(workers[i], NULL);
+
+  for (int i=0; i<njobs; i++)
+    minsk_free(jobs[i].m);
+  return batch_errors ? 1 : 0;
 }
 
 static const struct option longopts[] = {
   { "cpu-quota",	required_argument, 	NULL, 'q' },
   { "daemon",		no_argument, 		NULL, 'd' },
   { "nofork",		no_argument, 		NULL, 'n' },
+  { "workers",		required_argument,	NULL, 'w' },
+  { "batch",		no_argument,		NULL, 'b' },
+  { "threads",		required_argument,	NULL, 'j' },
+  { "image",		no_argument,		NULL, 'i' },
+  { "convert",		no_argument,		NULL, 'c' },
+  { "translate",	no_argument,		NULL, 'x' },
   { "english",		no_argument,		NULL, 'e' },
   { "set-password",	no_argument,		NULL, 's' },
-  { "upgrade",		no_argument,		NULL, 'u' },
+  { "upgrade",		optional_argument,	NULL, 'u' },
   { "print-quota",	required_argument, 	NULL, 'p' },
+  { "flush",		required_argument,	NULL, 'f' },
+  { "no-loop-check",	no_argument,		NULL, 'L' },
   { "trace",		required_argument, 	NULL, 't' },
+  { "profile",		no_argument,		NULL, 'P' },
+  { "sample",		required_argument,	NULL, 'S' },
+  { "folded",		required_argument,	NULL, 'F' },
+  { "recorder",		required_argument,	NULL, 'r' },
+  { "trace-file",	required_argument,	NULL, 'T' },
   { NULL,		0, 			NULL, 0   },
 };
 
@@ -1318,15 +933,28 @@ static void usage(void)
   fprintf(stderr, "\
 -d, --daemon		Run as daemon and listen for network connections\n\
 -n, --nofork		When run with --daemon, avoid forking\n\
+-w, --workers=<n>	When run with --daemon, serve by <n> pre-forked workers per CPU\n\
 ");
   #endif
   fprintf(stderr, "\
+-b, --batch		Run programs from files given as arguments, writing <file>.out\n\
+-j, --threads=<n>	Number of worker threads in batch mode (default: one per CPU)\n\
+-i, --image		Programs are memory images instead of text\n\
+-c, --convert		Convert the program on stdin to a memory image on stdout\n\
+-x, --translate		Translate the program on stdin to a C program on stdout (see README)\n\
 -e, --english		Print messages in English\n\
 -s, --set-password	Put hidden password in memory\n\
--u, --upgrade		Upgrade the Minsk-2 to the Minsk-22\n\
+-u, --upgrade[=<n>]	Upgrade the Minsk-2 to the Minsk-22 (or to <n> memory blocks)\n\
 -t, --trace=<level>	Enable tracing of program execution\n\
+-T, --trace-file=<file>	Record a binary trace to <file> (see minsk-trace)\n\
+-P, --profile		Report where the program spends its time (to stderr)\n\
+-S, --sample=<hz>	Sample the running program <hz> times per CPU second, report to stderr\n\
+-F, --folded=<file>	Write the samples to <file> as folded stacks for flame graphs\n\
+-r, --recorder=<n>	After a crash, list the last <n> instructions (default: 16)\n\
 -q, --cpu-quota=<n>	Set CPU quota to <n> instructions\n\
 -p, --print-quota=<n>	Set printer quota to <n> lines\n\
+-f, --flush=<n>		Flush printer output every <n> lines (0 = when the program stops)\n\
+-L, --no-loop-check	Do not stop programs caught in an infinite loop before the CPU quota runs out\n\
 ");
   exit(1);
 }
@@ -1336,17 +964,39 @@ int main(int argc, char **argv)
   int opt;
   int daemon_mode = 0;
   int do_fork = 1;
-  int set_password = 0;
+  int prefork = 0;
+  int batch = 0;
+  int threads = 0;
+  int convert = 0;
+  int translate = 0;
 
-  while ((opt = getopt_long(argc, argv, "q:desunp:t:", longopts, NULL)) >= 0)
+  while ((opt = getopt_long(argc, argv, "q:desu::np:t:T:r:PS:F:bj:w:icxf:L", longopts, NULL)) >= 0)
     switch (opt)
       {
+      case 'w':
+	prefork = atoi(optarg);
+	break;
+      case 'b':
+	batch = 1;
+	break;
+      case 'j':
+	threads = atoi(optarg);
+	break;
       case 'd':
 	daemon_mode = 1;
 	break;
       case 'n':
 	do_fork = 0;
 	break;
+      case 'i':
+	image = 1;
+	break;
+      case 'c':
+	convert = 1;
+	break;
+      case 'x':
+	translate = 1;
+	break;
       case 'e':
 	english = 1;
 	break;
@@ -1354,7 +1004,9 @@ int main(int argc, char **argv)
 	set_password = 1;
 	break;
       case 'u':
-	memblocks = 2;
+	memblocks = optarg ? atoi(optarg) : 2;
+	if (memblocks < 1 || memblocks > 4096)
+	  usage();
 	break;
       case 'p':
 	print_quota = atoi(optarg);
@@ -1362,23 +1014,105 @@ int main(int argc, char **argv)
       case 'q':
 	cpu_quota = atoi(optarg);
 	break;
+      case 'f':
+	flush_lines = atoi(optarg);
+	break;
+      case 'L':
+	no_loop_check = 1;
+	break;
       case 't':
 	trace = atoi(optarg);
 	break;
+      case 'P':
+	profile = 1;
+	break;
+      case 'S':
+	sample_hz = atoi(optarg);
+	break;
+      case 'F':
+	folded_file = optarg;
+	break;
+      case 'r':
+	recorder = atoi(optarg);
+	break;
+      case 'T':
+	trace_file = optarg;
+	break;
       default:
 	usage();
       }
-  if (optind < argc)
+  if (optind < argc && !batch)
     usage();
+  if (folded_file && !sample_hz)
+    sample_hz = 1000;
+
+  if (batch)
+    return run_batch(argv + optind, threads);
 
   setproctitle_init(argc, argv);
-  init_memory(set_password);
+  struct minsk_machine *m = new_machine();
+  if (set_password)
+    minsk_set_password(m);
 
   if (daemon_mode)
-    run_as_daemon(do_fork);
+    run_as_daemon(m, do_fork, prefork);
 
-  parse_in();
-  run();
+  if (convert)
+    {
+      if (minsk_convert(m, stdin, stdout) != MINSK_RUNNING)
+	{
+	  minsk_report(m, stderr, english);
+	  return 1;
+	}
+      if (fflush(stdout) || ferror(stdout))
+	die("Write error");
+      return 0;
+    }
 
+  if (translate)
+    {
+      if (load_program(m, stdin) != MINSK_RUNNING)
+	{
+	  minsk_report(m, stderr, english);
+	  return 1;
+	}
+      minsk_translate(m, stdout);
+      if (fflush(stdout) || ferror(stdout))
+	die("Write error");
+      return 0;
+    }
+
+  FILE *tf = NULL;
+  if (trace_file)
+    {
+      if (!(tf = fopen(trace_file, "wb")))
+	die("Cannot create the trace file");
+      minsk_set_binary_trace(m, tf);
+    }
+
+  if (load_program(m, stdin) == MINSK_RUNNING)
+    minsk_run(m);
+  minsk_report(m, stdout, english);
+  fflush(stdout);
+  post_mortem(m, stderr);
+  minsk_profile_report(m, stderr);
+  if (folded_file)
+    {
+      FILE *ff = fopen(folded_file, "w");
+      if (!ff)
+	die("Cannot create the folded stacks file");
+      minsk_sample_report(m, ff, 1);
+      if (fclose(ff))
+	die("Cannot write the folded stacks file");
+    }
+  else
+    minsk_sample_report(m, stderr, 0);
+
+  if (tf)
+    {
+      minsk_set_binary_trace(m, NULL);
+      if (fclose(tf))
+	die("Cannot write the trace file");
+    }
   return 0;
 }
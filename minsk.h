@@ -0,0 +1,226 @@
+/*
+ *	Minsk-2 Emulator -- The Machine as a Library
+ *
+ *	(c) 2010 Martin Mares <mj@ucw.cz>
+ */
+
+#ifndef _MINSK_H
+#define _MINSK_H
+
+#include <stdio.h>
+
+/*
+ *  Everything the emulator knows about one machine lives in a struct
+ *  minsk_machine, so a single process can run any number of programs,
+ *  one after another or on several machines at once (one machine must
+ *  not be used by multiple threads at the same time, though).
+ *
+ *  A typical use:
+ *
+ *	struct minsk_machine *m = minsk_new(1);
+ *	minsk_set_cpu_quota(m, 100000);
+ *	if (!minsk_load(m, stdin))
+ *	  minsk_run(m);
+ *	minsk_report(m, stdout, 1);
+ *	minsk_free(m);
+ */
+
+// Minsk-2 has 37-bit words in sign-magnitude representation (bit 36 = sign)
+typedef unsigned long long int minsk_word;
+
+// Why the machine stopped
+enum minsk_status {
+  MINSK_RUNNING,			// Not stopped yet
+  MINSK_HALTED,				// Executed the halt instruction
+  MINSK_OVERFLOW,
+  MINSK_NOT_IMPLEMENTED,		// Instruction for a device we do not emulate
+  MINSK_ILLEGAL,			// Illegal instruction
+  MINSK_CPU_QUOTA,			// CPU quota exceeded
+  MINSK_OUT_OF_PAPER,			// Printer quota exceeded
+  MINSK_PARSE_ERROR,			// The program could not be loaded
+  MINSK_INFINITE_LOOP,			// Returned to the same state (see minsk_set_loop_check())
+};
+
+struct minsk_regs {
+  minsk_word acc, r1, r2;
+  int ip;				// Next instruction to execute
+  int prev_ip;				// Instruction executed last
+};
+
+struct minsk_usage {
+  int instructions;			// Executed (counted only against a CPU quota)
+  int lines;				// Printed (counted only against a printer quota)
+};
+
+struct minsk_machine;
+
+// Create a machine with 1 memory block (Minsk-2), 2 blocks (Minsk-22) or more; NULL if out of memory
+struct minsk_machine *minsk_new(int memblocks);
+void minsk_free(struct minsk_machine *m);
+
+// Clear the memory and registers and re-arm the quotas, keeping all settings
+void minsk_reset(struct minsk_machine *m);
+
+// Settings: where to print (stdout by default), trace level, quotas (<= 0 for unlimited)
+void minsk_set_output(struct minsk_machine *m, FILE *out);
+void minsk_set_trace(struct minsk_machine *m, int level);
+void minsk_set_cpu_quota(struct minsk_machine *m, int instructions);
+void minsk_set_print_quota(struct minsk_machine *m, int lines);
+
+// Flush the output after every <lines> printed lines (1 by default), or only when the machine stops (0)
+void minsk_set_flush(struct minsk_machine *m, int lines);
+
+// Stop a program which is provably caught in an infinite loop instead of letting it run out of the CPU quota (on by
+// default); finds loops which keep returning to the same state without changing the memory, unless tracing or profiling
+void minsk_set_loop_check(struct minsk_machine *m, int enable);
+
+// Keep the last <instructions> executed instructions in the flight recorder (16 by default, 0 to disable); 0 if out of memory
+int minsk_set_recorder(struct minsk_machine *m, int instructions);
+
+// Count instructions, opcodes and jumps while minsk_run() runs (without translating code); 0 if out of memory
+int minsk_set_profile(struct minsk_machine *m, int enable);
+
+// Sample the instruction being executed <hz> times per second of CPU time while minsk_run() runs (0 to stop);
+// installs a SIGPROF handler; 0 if out of memory or the handler cannot be installed
+int minsk_set_sampling(struct minsk_machine *m, int hz);
+// Record a binary trace to the given file instead of tracing as text (NULL to stop)
+void minsk_set_binary_trace(struct minsk_machine *m, FILE *f);
+
+// Fill the memory with halt instructions and hide a password there (for contests)
+void minsk_set_password(struct minsk_machine *m);
+
+// Load a program in the text format; returns MINSK_RUNNING or MINSK_PARSE_ERROR
+// (if the stream has a file descriptor, it is read directly, so nothing must be buffered in the stream yet)
+enum minsk_status minsk_load(struct minsk_machine *m, FILE *in);
+
+// Load a memory image (see minsk_convert) from a file descriptor; mapped if possible, read otherwise
+enum minsk_status minsk_load_image(struct minsk_machine *m, int fd);
+
+// Load a program in the text format and write the memory image of it
+enum minsk_status minsk_convert(struct minsk_machine *m, FILE *in, FILE *out);
+
+// Run until the machine stops, or execute a single instruction
+enum minsk_status minsk_run(struct minsk_machine *m);
+enum minsk_status minsk_step(struct minsk_machine *m);
+
+// Inspect and modify the machine
+enum minsk_status minsk_status(struct minsk_machine *m);
+void minsk_get_regs(struct minsk_machine *m, struct minsk_regs *regs);
+// What was used of the quotas since the last reset
+void minsk_get_usage(struct minsk_machine *m, struct minsk_usage *usage);
+minsk_word minsk_read(struct minsk_machine *m, int block, int address);
+void minsk_write(struct minsk_machine *m, int block, int address, minsk_word val);
+
+// Describe why the machine stopped: a short reason, or the full message as the console shows it
+const char *minsk_message(struct minsk_machine *m, int english);
+void minsk_report(struct minsk_machine *m, FILE *f, int english);
+
+// Report hot instructions, loops, jumps and opcodes of the profile
+void minsk_profile_report(struct minsk_machine *m, FILE *f);
+
+// Report the samples as a histogram, or as folded stacks ("<emulator state>;@<address> <samples>") for flame graph tools
+void minsk_sample_report(struct minsk_machine *m, FILE *f, int folded);
+// List the instructions in the flight recorder, oldest first (only the registers before each of them are known)
+void minsk_dump_recorder(struct minsk_machine *m, FILE *f, int english);
+
+/*
+ *  Binary traces start with a header ("MINSKTRC", version and record size
+ *  as 32-bit numbers), followed by 16-byte records. All numbers are
+ *  little-endian. Every executed instruction produces:
+ *
+ *	MINSK_TR_INS	a = x operand, b = y operand (before indexing),
+ *			val = instruction word | IP << 48
+ *	MINSK_TR_INDEX	a, b = indexed operands (if the instruction is indexed)
+ *	MINSK_TR_RD/WR	a = address, val = value read or written
+ *	MINSK_TR_REG	reg = 0 for ACC, 1 for R1, 2 for R2, val = its new value
+ *			(only registers which changed since the last MINSK_TR_END)
+ *	MINSK_TR_END	the instruction is finished
+ *
+ *  An instruction which stops the machine has no MINSK_TR_END.
+ */
+
+#define MINSK_TRACE_MAGIC "MINSKTRC"
+#define MINSK_TRACE_VERSION 1
+
+enum minsk_trace_type {
+  MINSK_TR_INS = 1,
+  MINSK_TR_INDEX,
+  MINSK_TR_RD,
+  MINSK_TR_WR,
+  MINSK_TR_REG,
+  MINSK_TR_END,
+};
+
+struct minsk_trace_record {
+  unsigned char type;
+  unsigned char a_block, b_block;
+  unsigned char reg;
+  unsigned short a_address, b_address;
+  minsk_word val;
+};
+
+// Render a binary trace as text in the format of the given trace level; returns 0, or -1 if it is damaged
+int minsk_decode_trace(FILE *in, FILE *out, int level);
+
+/*
+ *  Ahead-of-time translation. minsk_translate() writes the loaded program
+ *  as a C program, which contains the memory of the machine and a function
+ *  running the program natively, and links with this library. The function
+ *  starts at one of the blocks entered by a jump (flagged MINSK_NATIVE_ENTRY)
+ *  and goes on until it returns MINSK_NATIVE_JUMP (to the block at ip, which
+ *  the CPU quota was not charged for yet), MINSK_NATIVE_INTERP (the
+ *  interpreter should execute the instruction at ip) or MINSK_NATIVE_OVERFLOW
+ *  (the instruction at prev_ip overflowed). After changing a cell flagged
+ *  in watch[], it must call changed() and must not enter blocks flagged in
+ *  stale[], whose code has changed since the translation. Return addresses
+ *  stored by subroutine calls (flagged MINSK_NATIVE_LINK) are read when
+ *  jumping there instead. minsk_reset() drops the translation along with
+ *  the memory.
+ */
+
+struct minsk_native_state {
+  minsk_word acc, r1;
+  minsk_word r2;			// Accumulator before the last jump
+  long long quota;			// CPU quota left (<= 0 for unlimited)
+  unsigned long long effects;		// Memory cells changed (see minsk_set_loop_check())
+  unsigned long long quiet;		// Effects at the last block entry
+  int loop_check;			// Return before entering a block if the one before changed no cell
+  minsk_word *mem;			// Memory block 0
+  const unsigned char *watch;
+  const unsigned char *stale;
+  struct minsk_machine *machine;
+  void (*changed)(struct minsk_machine *m, int addr);
+  int ip;
+  int prev_ip;				// Last jump (or the instruction which overflowed)
+  int block_end;			// Last instruction of the block charged last
+};
+
+enum minsk_native_status {
+  MINSK_NATIVE_JUMP,
+  MINSK_NATIVE_INTERP,
+  MINSK_NATIVE_OVERFLOW,
+};
+
+// Flags of memory cells in a translation
+#define MINSK_NATIVE_CODE 1		// Instruction reachable from the start
+#define MINSK_NATIVE_ENTRY 2		// The function can start here
+#define MINSK_NATIVE_END 4		// Instruction ending a block
+#define MINSK_NATIVE_LINK 8		// Return address of a subroutine call, ending a block
+
+struct minsk_translation {
+  const minsk_word *image;		// Memory block 0 as translated
+  const unsigned char *flags;		// MINSK_NATIVE_xxx for every cell of block 0
+  int (*run)(struct minsk_native_state *s);
+};
+
+// Write the loaded program as a C program running it natively
+void minsk_translate(struct minsk_machine *m, FILE *out);
+
+// Run the program loaded from the image of the translation natively (NULL to stop); 0 if out of memory
+int minsk_set_translation(struct minsk_machine *m, const struct minsk_translation *t);
+
+// Result of the arithmetic instruction <op> (004 to 077, 0170, 0171) on operands <a> (y or R2) and <b> (x)
+minsk_word minsk_arith(int op, minsk_word a, minsk_word b);
+#define MINSK_ARITH_OVERFLOW (~(minsk_word) 0)
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ *	Minsk-2 Emulator -- Test of Fixed-Point Multiplication and Division
+ *
+ *	(c) 2010 Martin Mares <mj@ucw.cz>
+ */
+
+/*
+ *  Compares FIX multiplication (030), division (040) and the bottom part
+ *  of multiplication (0170) as computed by minsk_arith() with exact 128-bit
+ *  arithmetic and with the double formulas the emulator used before. The
+ *  results must be exact and they may differ from the old ones only by one
+ *  unit in the last place, where the double rounding went up; overflows
+ *  must be decided the same way. The operands are all pairs of boundary
+ *  values and random pairs. Usage: test-fix [<millions of random pairs>]
+ */
+
+#include "minsk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef minsk_word word;
+typedef unsigned __int128 wide;
+
+#define SIGN_MASK 01000000000000ULL
+#define  VAL_MASK 00777777777777ULL
+#define OVERFLOW MINSK_ARITH_OVERFLOW
+
+static int wsign(word w)
+{
+  return (w & SIGN_MASK) ? -1 : 1;
+}
+
+static word wabs(word w)
+{
+  return w & VAL_MASK;
+}
+
+static word wsigned(word mag, int negative)
+{
+  return mag ? mag | (negative ? SIGN_MASK : 0) : 0;
+}
+
+/*** The old double formulas ***/
+
+static long long wtoll(word w)
+{
+  if (wsign(w) < 0)
+    return -wabs(w);
+  else
+    return wabs(w);
+}
+
+static word wfromll(long long x)
+{
+  word w = ((x < 0) ? -x : x) & VAL_MASK;
+  if (x < 0)
+    w |= SIGN_MASK;
+  return w;
+}
+
+static double wtofrac(word w)
+{
+  return (double)wtoll(w) / (double)(1ULL << 36);
+}
+
+static word wfromfrac(double d)
+{
+  return wfromll((long long)(d * (double)(1ULL << 36)));
+}
+
+static int frac_in_range(double d)
+{
+  return (d > -1. && d < 1.);
+}
+
+static word old_mul(word a, word b)
+{
+  double d = wtofrac(a) * wtofrac(b);
+  return frac_in_range(d) ? wfromfrac(d) : OVERFLOW;
+}
+
+static word old_div(word a, word b)
+{
+  if (!wabs(b))
+    return OVERFLOW;
+  double d = wtofrac(a) / wtofrac(b);
+  return frac_in_range(d) ? wfromfrac(d) : OVERFLOW;
+}
+
+static word old_mul_low(word a, word b)
+{
+  if (wtofrac(a) * wtofrac(b) >= .1/(1ULL << 32))
+    return OVERFLOW;
+  return wfromll(((unsigned long long)wabs(a) * (unsigned long long)wabs(b)) & VAL_MASK);
+}
+
+/*** Checks ***/
+
+static unsigned long long tested, failed, ulp_diffs[2];
+
+static void fail(int op, word a, word b, word got, word exact, word old, const char *why)
+{
+  if (failed++ < 20)
+    printf("%03o(%c%012llo, %c%012llo): got %012llo, exact %012llo, old %012llo: %s\n",
+	   op, (wsign(a) < 0 ? '-' : '+'), wabs(a), (wsign(b) < 0 ? '-' : '+'), wabs(b), got, exact, old, why);
+}
+
+// A result of the old formula which is one unit above the exact one is allowed if the exact quotient (num/den) is below it
+static void compare(int op, word a, word b, word got, word exact, word old, wide num, wide den)
+{
+  tested++;
+  if (got != exact)
+    fail(op, a, b, got, exact, old, "inexact");
+  else if ((got == OVERFLOW) != (old == OVERFLOW))
+    fail(op, a, b, got, exact, old, "overflow differs");
+  else if (got != old)
+    {
+      int negative = (wsign(a) != wsign(b));
+      if (old != wsigned(wabs(exact) + 1, negative) || (wide) wabs(old) * den <= num)
+	fail(op, a, b, got, exact, old, "differs from the old result by more than the double rounding");
+      else
+	ulp_diffs[op == 040]++;
+    }
+}
+
+static void check(word a, word b)
+{
+  int negative = (wsign(a) != wsign(b));
+  wide p = (wide) wabs(a) * wabs(b);
+
+  compare(030, a, b, minsk_arith(030, a, b), wsigned(p >> 36, negative), old_mul(a, b), p, (wide) 1 << 36);
+
+  word q = (wabs(a) < wabs(b)) ? wsigned(((wide) wabs(a) << 36) / wabs(b), negative) : OVERFLOW;
+  compare(040, a, b, minsk_arith(040, a, b), q, old_div(a, b), (wide) wabs(a) << 36, wabs(b));
+
+  // The overflow limit of the bottom part is defined by the old formula only
+  word low = old_mul_low(a, b);
+  if (low != OVERFLOW)
+    low = (word) p & VAL_MASK;
+  compare(0170, a, b, minsk_arith(0170, a, b), low, old_mul_low(a, b), 0, 0);
+}
+
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+static unsigned long long rng(void)
+{
+  // xorshift64*
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+// Random sign and a magnitude of random length, so that small operands are frequent, too
+static word random_word(void)
+{
+  unsigned long long r = rng();
+  int bits = 1 + (r >> 58) % 36;
+  return (rng() & (VAL_MASK >> (36 - bits))) | ((r & 1) ? SIGN_MASK : 0);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long long random_pairs = (argc > 1 ? atoll(argv[1]) : 4) * 1000000;
+  word edge[256];
+  int nedge = 0;
+
+  // Zero, one, all ones, powers of two and their neighbours, both positive and negative
+  word mags[128];
+  int nmags = 0;
+  mags[nmags++] = 0;
+  for (int i=0; i<36; i++)
+    {
+      mags[nmags++] = 1ULL << i;
+      mags[nmags++] = (2ULL << i) - 1;
+      if (i >= 2)
+	mags[nmags++] = (1ULL << i) + 1;
+    }
+  for (int i=0; i<nmags; i++)
+    {
+      edge[nedge++] = mags[i];
+      edge[nedge++] = mags[i] | SIGN_MASK;
+    }
+
+  for (int i=0; i<nedge; i++)
+    for (int j=0; j<nedge; j++)
+      check(edge[i], edge[j]);
+  for (unsigned long long i=0; i<random_pairs; i++)
+    {
+      word a = random_word(), b = random_word();
+      check(a, b);
+      // Full-length magnitudes, which are the likeliest to show rounding
+      check(a | (1ULL << 35), b | (1ULL << 35));
+    }
+
+  printf("Tested %llu cases, %llu failed; the old double formulas were one unit above in %llu multiplications and %llu divisions\n",
+	 tested, failed, ulp_diffs[0], ulp_diffs[1]);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,94 @@
+/*
+ *	Minsk-2 Emulator -- Test of the CPU Quota
+ *
+ *	(c) 2010 Martin Mares <mj@ucw.cz>
+ */
+
+/*
+ *  Checks that the instructions counted against the CPU quota are those
+ *  which were executed, even if the machine stops in the middle of a block
+ *  charged at once. Every program runs with the block engines (and the
+ *  translated code, if any) and with tracing, which counts instruction
+ *  by instruction, on both the Minsk-2 and the Minsk-22.
+ */
+
+#define _GNU_SOURCE
+
+#include "minsk.h"
+
+#include <stdio.h>
+#include <string.h>
+
+struct test {
+  const char *name;
+  const char *program;
+  enum minsk_status status;
+  int instructions;			// Expected usage, or 0 if only compared with tracing
+};
+
+static const struct test tests[] = {
+  { "overflow at the start of a block",
+    "@0050\n+10 00 1000 1000\n+00 00 0000 0000\n+00 00 0000 0000\n+00 00 0000 0000\n+00 00 0000 0000\n"
+    "-62 00 1000 0000\n-77 00 0000 0000\n@1000\n+777777777777\n",
+    MINSK_OVERFLOW, 1 },
+  { "overflow in the middle of a block",
+    "@0050\n+00 00 0000 0000\n+00 00 0000 0000\n+40 00 1001 1000\n+00 00 0000 0000\n-77 00 0000 0000\n"
+    "@1000\n+000000000001\n+000000000000\n",
+    MINSK_OVERFLOW, 3 },
+  { "illegal instruction after a straight line",
+    "@0050\n+00 00 0000 0000\n+00 00 0000 0000\n-01 00 0000 0000\n-77 00 0000 0000\n",
+    MINSK_ILLEGAL, 3 },
+  { "overflow in a hot loop",
+    "@0050\n+00 00 0000 0000\n+11 00 1001 1000\n+00 00 0000 0000\n+00 00 0000 0000\n-30 00 0050 1010\n"
+    "@1000\n+000000000000\n+000100000000\n",
+    MINSK_OVERFLOW, 0 },
+};
+
+static int run(const struct test *t, int memblocks, int trace, int *instructions)
+{
+  struct minsk_machine *m = minsk_new(memblocks);
+  FILE *null = fopen("/dev/null", "w");
+  FILE *in = fmemopen((void *) t->program, strlen(t->program), "r");
+  if (!m || !null || !in)
+    {
+      fprintf(stderr, "test-quota: Cannot set up the machine\n");
+      return -1;
+    }
+  minsk_set_output(m, null);
+  minsk_set_trace(m, trace);
+  minsk_set_cpu_quota(m, 1000000);
+  enum minsk_status status = minsk_load(m, in);
+  if (status == MINSK_RUNNING)
+    status = minsk_run(m);
+
+  struct minsk_usage u;
+  minsk_get_usage(m, &u);
+  *instructions = u.instructions;
+  fclose(in);
+  fclose(null);
+  minsk_free(m);
+  return status;
+}
+
+int main(void)
+{
+  int failed = 0;
+
+  for (unsigned int i=0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    for (int memblocks=1; memblocks<=2; memblocks++)
+      {
+	const struct test *t = &tests[i];
+	int blocks, traced;
+	int sb = run(t, memblocks, 0, &blocks);
+	int st = run(t, memblocks, 1, &traced);
+	if (sb != (int) t->status || st != (int) t->status || blocks != traced || (t->instructions && blocks != t->instructions))
+	  {
+	    printf("%s (%d blocks): status %d/%d, expected %d; %d instructions, %d when tracing, expected %d\n",
+		   t->name, memblocks, sb, st, t->status, blocks, traced, t->instructions);
+	    failed++;
+	  }
+      }
+
+  printf("Tested %d cases, %d failed\n", (int) (2 * sizeof(tests) / sizeof(tests[0])), failed);
+  return failed ? 1 : 0;
+}